@@ -1,14 +1,427 @@
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
 #include "device.h"
 
 std::vector<flashcart_core::Flashcart*> *flashcart_core::flashcart_list = nullptr;
 
+const uint32_t flashcart_core::Flashcart::READ_CACHE_LINE;
+const uint32_t flashcart_core::Flashcart::WRITE_STEP_SIZE;
+
 flashcart_core::Flashcart::Flashcart(const char* name, const size_t max_length)
-    : m_name(name), m_max_length(max_length) {
+    : m_name(name), m_max_length(max_length), m_cache_max_lines(0), m_cache_clock(0),
+    m_verify_writes(false), m_verify_failure{0, 0}, m_job() {
     if (flashcart_list == nullptr) {
         flashcart_list = new std::vector<Flashcart*>();
     }
     flashcart_list->push_back(this);
 }
+
+void flashcart_core::waitDelay(uint32_t us) {
+    while (us) {
+        const uint32_t slice = us < WAIT_SLICE_US ? us : WAIT_SLICE_US;
+        if (!platform::yieldWait(slice)) {
+            platform::ioDelay(slice);
+        }
+        us -= slice;
+    }
+}
+
+bool flashcart_core::Flashcart::writeSegments(const WriteSegment *segments, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (!writeFlash(segments[i].address, segments[i].length, segments[i].data)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool flashcart_core::Flashcart::startWrite(const WriteSegment *segments, size_t count) {
+    resetJob();
+    m_job.state = WriteJob::SYNC;
+    m_job.segments = segments;
+    m_job.count = count;
+    return true;
+}
+
+flashcart_core::Flashcart::StepResult flashcart_core::Flashcart::writeStep() {
+    switch (m_job.state) {
+        case WriteJob::IDLE:
+            platform::logMessage(LOG_ERR, "%s: writeStep without startWrite", m_name);
+            return STEP_FAILED;
+        case WriteJob::SYNC: {
+            const bool ok = writeSegments(m_job.segments, m_job.count);
+            resetJob();
+            return ok ? STEP_DONE : STEP_FAILED;
+        }
+        default:
+            return blockStep();
+    }
+}
+
+bool flashcart_core::Flashcart::rmwEraseStart(const EraseBlock &block) {
+    return rmwErase(block);
+}
+
+bool flashcart_core::Flashcart::writeBlocks(const WriteSegment *segments, size_t count) {
+    if (!startBlocks(segments, count, 0)) {
+        return false;
+    }
+    StepResult result;
+    while ((result = blockStep()) == STEP_MORE) {
+        if (m_job.state == WriteJob::ERASE_WAIT) {
+            platform::yieldWait(0);
+        }
+    }
+    return result == STEP_DONE;
+}
+
+bool flashcart_core::Flashcart::startBlocks(const WriteSegment *segments, size_t count, uint32_t slice) {
+    resetJob();
+    resetVerifyFailure();
+
+    uint32_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (i && segments[i].address < segments[i - 1].address + segments[i - 1].length) {
+            platform::logMessage(LOG_ERR, "%s: write segments overlap or aren't sorted", m_name);
+            return false;
+        }
+        total += segments[i].length;
+    }
+
+    m_job.state = WriteJob::NEXT_BLOCK;
+    m_job.segments = segments;
+    m_job.count = count;
+    m_job.slice = slice;
+    m_job.total = total;
+    m_job.address = count ? segments[0].address : 0;
+    return true;
+}
+
+void flashcart_core::Flashcart::resetJob() {
+    std::free(m_job.block);
+    m_job = WriteJob();
+}
+
+// the part of segments[i] that's in the current block
+void flashcart_core::Flashcart::jobPart(size_t i, uint32_t &start, uint32_t &len) const {
+    const WriteSegment &seg = m_job.segments[i];
+    const uint32_t eb_end = m_job.eb.address + m_job.eb.size;
+    const uint32_t seg_end = seg.address + seg.length;
+    start = seg.address > m_job.address ? seg.address : m_job.address;
+    len = (seg_end < eb_end ? seg_end : eb_end) - start;
+}
+
+flashcart_core::Flashcart::StepResult flashcart_core::Flashcart::blockStep() {
+    WriteJob &job = m_job;
+    switch (job.state) {
+        case WriteJob::NEXT_BLOCK:
+            break;
+        case WriteJob::ERASE_WAIT:
+            if (rmwBusy()) {
+                return STEP_MORE;
+            }
+            job.state = WriteJob::PROGRAM;
+            // fall through
+        case WriteJob::PROGRAM:
+            return programStep();
+        default:
+            return STEP_FAILED;
+    }
+
+    // job.first is the first segment that isn't written yet
+    while (job.first < job.count && (!job.segments[job.first].length ||
+            job.segments[job.first].address + job.segments[job.first].length <= job.address)) {
+        job.first++;
+    }
+    if (job.first == job.count) {
+        resetJob();
+        return STEP_DONE;
+    }
+    if (job.address < job.segments[job.first].address) {
+        job.address = job.segments[job.first].address;
+    }
+
+    job.eb = eraseBlockAt(job.address);
+    if (!job.eb.size) {
+        platform::logMessage(LOG_ERR, "%s: no erase block at 0x%08x", m_name, job.address);
+        resetJob();
+        return STEP_FAILED;
+    }
+    if (job.eb.size > job.block_size) {
+        std::free(job.block);
+        job.block = static_cast<uint8_t *>(std::malloc(job.eb.size));
+        job.block_size = job.block ? job.eb.size : 0;
+        if (!job.block) {
+            platform::logMessage(LOG_ERR, "%s: failed to allocate 0x%x bytes", m_name, job.eb.size);
+            resetJob();
+            return STEP_FAILED;
+        }
+    }
+
+    const uint32_t eb_end = job.eb.address + job.eb.size;
+    job.last = job.first;
+    while (job.last < job.count && job.segments[job.last].address < eb_end) {
+        job.last++;
+    }
+
+    if (!readCached(job.eb.address, job.eb.size, job.block)) {
+        return endBlock(false);
+    }
+    const bool trusted = rmwReadTrusted();
+    bool changed = !trusted, need_erase = !trusted;
+    for (size_t i = job.first; i < job.last && !need_erase; i++) {
+        uint32_t start, len;
+        jobPart(i, start, len);
+        const uint8_t *src = job.segments[i].data + (start - job.segments[i].address);
+        const uint8_t *old = job.block + (start - job.eb.address);
+        for (uint32_t j = 0; j < len && !need_erase; j++) {
+            changed |= src[j] != old[j];
+            need_erase = (src[j] & ~old[j]) != 0;
+        }
+    }
+
+    job.changed = changed || need_erase;
+    job.erased = need_erase;
+    job.part = need_erase ? 0 : job.first;
+    job.offset = 0;
+    if (need_erase) {
+        for (size_t i = job.first; i < job.last; i++) {
+            uint32_t start, len;
+            jobPart(i, start, len);
+            std::memcpy(job.block + (start - job.eb.address), job.segments[i].data + (start - job.segments[i].address), len);
+        }
+        if (!rmwEraseStart(job.eb)) {
+            return endBlock(false);
+        }
+        job.state = WriteJob::ERASE_WAIT;
+        return STEP_MORE;
+    }
+    if (changed) {
+        job.state = WriteJob::PROGRAM;
+        return STEP_MORE;
+    }
+    platform::logMessage(LOG_DEBUG, "%s: block 0x%08x unchanged", m_name, job.eb.address);
+    return endBlock(true);
+}
+
+// Programs the next slice of the current block (all of it if there's no slice limit).
+flashcart_core::Flashcart::StepResult flashcart_core::Flashcart::programStep() {
+    WriteJob &job = m_job;
+    if (job.erased) {
+        const uint32_t rest = job.eb.size - job.offset;
+        const uint32_t n = job.slice && job.slice < rest ? job.slice : rest;
+        if (!rmwProgram(job.eb.address + job.offset, n, job.block + job.offset, nullptr)) {
+            return endBlock(false);
+        }
+        job.offset += n;
+        if (job.offset < job.eb.size) {
+            return STEP_MORE;
+        }
+        // the whole block was rewritten, so the preserved data is checked too
+        return endBlock(!m_verify_writes || verifyWrite(job.eb.address, job.eb.size, job.block));
+    }
+
+    for (; job.part < job.last; job.part++, job.offset = 0) {
+        uint32_t start, len;
+        jobPart(job.part, start, len);
+        const uint8_t *src = job.segments[job.part].data + (start - job.segments[job.part].address);
+        const uint8_t *old = job.block + (start - job.eb.address);
+        while (job.offset < len) {
+            const uint32_t rest = len - job.offset;
+            const uint32_t n = job.slice && job.slice < rest ? job.slice : rest;
+            const uint32_t at = job.offset;
+            job.offset += n;
+            if (!std::memcmp(old + at, src + at, n)) {
+                continue;
+            }
+            if (!rmwProgram(start + at, n, src + at, old + at) ||
+                    (m_verify_writes && !verifyWrite(start + at, n, src + at))) {
+                return endBlock(false);
+            }
+            if (job.slice) {
+                return STEP_MORE;
+            }
+        }
+    }
+    return endBlock(true);
+}
+
+flashcart_core::Flashcart::StepResult flashcart_core::Flashcart::endBlock(bool ok) {
+    WriteJob &job = m_job;
+    for (size_t i = job.first; i < job.last; i++) {
+        uint32_t start, len;
+        jobPart(i, start, len);
+        if (ok && job.changed) {
+            updateReadCache(start, len, job.segments[i].data + (start - job.segments[i].address));
+        }
+        job.done += len;
+    }
+    if (!ok) {
+        invalidateReadCache(job.eb.address, job.eb.size);
+        resetJob();
+        return STEP_FAILED;
+    }
+
+    job.address = job.eb.address + job.eb.size;
+    job.state = WriteJob::NEXT_BLOCK;
+    platform::showProgress(job.done, job.total, "Writing");
+    return STEP_MORE;
+}
+
+bool flashcart_core::Flashcart::verifyWrite(uint32_t address, uint32_t length, const uint8_t *expected) {
+    // Compared a read chunk at a time as it comes in, so only one chunk is ever held.
+    const uint32_t read_chunk = getReadChunkSize();
+    const uint32_t chunk = read_chunk > READ_CACHE_LINE ? read_chunk : READ_CACHE_LINE;
+    uint8_t *buf = static_cast<uint8_t *>(std::malloc(chunk));
+    if (!buf) {
+        platform::logMessage(LOG_ERR, "%s: failed to allocate 0x%x bytes", m_name, chunk);
+        return false;
+    }
+
+    bool ok = true;
+    for (uint32_t done = 0; ok && done < length;) {
+        const uint32_t len = length - done < chunk ? length - done : chunk;
+        if (!rmwRead(address + done, len, buf)) {
+            platform::logMessage(LOG_ERR, "%s: verify read at 0x%08x failed", m_name, address + done);
+            ok = false;
+        } else if (std::memcmp(buf, expected + done, len)) {
+            uint32_t i = 0;
+            while (buf[i] == expected[done + i]) {
+                i++;
+            }
+            const uint32_t bad = address + done + i;
+            m_verify_failure = eraseBlockAt(bad);
+            platform::logMessage(LOG_ERR, "%s: verify failed at 0x%08x (0x%02x, expected 0x%02x) in block 0x%08x+0x%x",
+                m_name, bad, buf[i], expected[done + i], m_verify_failure.address, m_verify_failure.size);
+            ok = false;
+        }
+        done += len;
+    }
+
+    std::free(buf);
+    return ok;
+}
+
+void flashcart_core::Flashcart::setReadCache(uint32_t budget) {
+    for (CacheLine &line : m_cache) {
+        std::free(line.data);
+    }
+    m_cache.clear();
+    m_cache_max_lines = budget / READ_CACHE_LINE;
+    m_cache_clock = 0;
+}
+
+flashcart_core::Flashcart::CacheLine *flashcart_core::Flashcart::findCacheLine(uint32_t address) {
+    for (CacheLine &line : m_cache) {
+        if (line.address == address) {
+            line.last_use = ++m_cache_clock;
+            return &line;
+        }
+    }
+    return nullptr;
+}
+
+// Returns a line for `address` for the caller to fill in, evicting the least recently used one if the
+// cache is full; or null if there's no memory for it.
+flashcart_core::Flashcart::CacheLine *flashcart_core::Flashcart::newCacheLine(uint32_t address) {
+    CacheLine *line = nullptr;
+    if (m_cache.size() < m_cache_max_lines) {
+        uint8_t *data = static_cast<uint8_t *>(std::malloc(READ_CACHE_LINE));
+        if (data) {
+            m_cache.push_back({address, 0, data});
+            line = &m_cache.back();
+        }
+    }
+    if (!line && !m_cache.empty()) {
+        line = &m_cache.front();
+        for (CacheLine &l : m_cache) {
+            if (l.last_use < line->last_use) {
+                line = &l;
+            }
+        }
+    }
+    if (line) {
+        line->address = address;
+        line->last_use = ++m_cache_clock;
+    }
+    return line;
+}
+
+bool flashcart_core::Flashcart::readCached(uint32_t address, uint32_t length, uint8_t *buffer, bool progress) {
+    if (!m_cache_max_lines) {
+        return rmwRead(address, length, buffer);
+    }
+
+    const uint32_t end = address + length;
+    const uint32_t cache_end = PAGE_ROUND_DOWN(static_cast<uint32_t>(getMaxLength()), READ_CACHE_LINE);
+
+    for (uint32_t cur = PAGE_ROUND_DOWN(address, READ_CACHE_LINE); cur < end;) {
+        if (cur >= cache_end) {
+            // past the end of the flash; nothing to cache
+            const uint32_t start = cur > address ? cur : address;
+            return rmwRead(start, end - start, buffer + (start - address));
+        }
+
+        const uint32_t start = cur > address ? cur : address;
+        const uint32_t stop = cur + READ_CACHE_LINE < end ? cur + READ_CACHE_LINE : end;
+        CacheLine *line = findCacheLine(cur);
+
+        if (!line && start == cur && stop == cur + READ_CACHE_LINE) {
+            // a run of whole lines that aren't cached is read in one go, straight into the buffer
+            uint32_t run_end = cur + READ_CACHE_LINE;
+            while (run_end + READ_CACHE_LINE <= end && run_end < cache_end && !findCacheLine(run_end)) {
+                run_end += READ_CACHE_LINE;
+            }
+            if (!rmwRead(cur, run_end - cur, buffer + (cur - address))) {
+                return false;
+            }
+            for (; cur < run_end; cur += READ_CACHE_LINE) {
+                if ((line = newCacheLine(cur))) {
+                    std::memcpy(line->data, buffer + (cur - address), READ_CACHE_LINE);
+                }
+            }
+        } else {
+            if (!line) {
+                line = newCacheLine(cur);
+                if (!line) {
+                    return rmwRead(address, length, buffer);
+                }
+                if (!rmwRead(cur, READ_CACHE_LINE, line->data)) {
+                    invalidateReadCache(cur, READ_CACHE_LINE);
+                    return false;
+                }
+            }
+            std::memcpy(buffer + (start - address), line->data + (start - cur), stop - start);
+            cur += READ_CACHE_LINE;
+        }
+
+        if (progress) {
+            platform::showProgress((cur < end ? cur : end) - address, length, "Reading");
+        }
+    }
+
+    return true;
+}
+
+void flashcart_core::Flashcart::updateReadCache(uint32_t address, uint32_t length, const uint8_t *data) {
+    for (CacheLine &line : m_cache) {
+        const uint32_t start = line.address > address ? line.address : address;
+        const uint32_t stop = line.address + READ_CACHE_LINE < address + length ? line.address + READ_CACHE_LINE : address + length;
+        if (start < stop) {
+            std::memcpy(line.data + (start - line.address), data + (start - address), stop - start);
+        }
+    }
+}
+
+void flashcart_core::Flashcart::invalidateReadCache(uint32_t address, uint32_t length) {
+    for (auto it = m_cache.begin(); it != m_cache.end();) {
+        if (it->address < address + length && address < it->address + READ_CACHE_LINE) {
+            std::free(it->data);
+            it = m_cache.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
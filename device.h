@@ -33,10 +33,246 @@ public:
     virtual const char *getDescription() { return ""; }
     virtual size_t getMaxLength() { return m_max_length; }
 
+    // Geometry, so callers can size and align their I/O to what the device does cheaply.
+    // Only meaningful after initialize().
+
+    struct EraseBlock {
+        uint32_t address;
+        uint32_t size; // 0 if there's no such block (or the driver doesn't know)
+    };
+
+    enum WriteFlags : uint32_t {
+        /// writeFlash reads back first and leaves unchanged data (and blocks) alone
+        WRITE_DIFFERENTIAL = BIT(0),
+        /// Bytes that are 0xFF after an erase aren't programmed
+        WRITE_SKIPS_BLANK = BIT(1),
+    };
+
+    /// The erase block that contains `address`. Writes that cover whole erase blocks avoid a read-modify-write.
+    virtual EraseBlock eraseBlockAt(uint32_t address) { return {address, 0}; }
+    /// The unit the flash is programmed in, in bytes.
+    virtual uint32_t getProgramSize() { return 1; }
+    /// Reads that are a multiple of (and aligned to) this many bytes go at full speed.
+    virtual uint32_t getReadChunkSize() { return 0x200; }
+    /// WriteFlags describing what writeFlash does to avoid work.
+    virtual uint32_t getWriteFlags() { return 0; }
+
+    struct WriteSegment {
+        uint32_t address;
+        uint32_t length;
+        const uint8_t *data;
+    };
+
+    /// Writes several ranges as one: the same as a writeFlash per segment, except that drivers that
+    /// can merge them erase and program each erase block at most once, however many segments touch it.
+    /// `segments` must be sorted by address and mustn't overlap. Not atomic: if it fails, some of the
+    /// segments may already have been written.
+    virtual bool writeSegments(const WriteSegment *segments, size_t count);
+
+    /// Keeps up to `budget` bytes of flash in RAM (in READ_CACHE_LINE sized pieces, least recently used
+    /// first out), so reading the same data again, e.g. the read-back before a write, doesn't touch the
+    /// cart. writeFlash keeps it up to date. 0 (the default) turns it off and frees it.
+    /// Set it up after initialize(), and turn it off before the cart can change. Only drivers built on
+    /// writeBlocks use it; for the others it's a no-op.
+    void setReadCache(uint32_t budget);
+
+    static const uint32_t READ_CACHE_LINE = 0x1000;
+
+    /// Makes writeFlash and writeSegments (and so injectNtrBoot) read back what they changed, a read
+    /// chunk at a time, and fail if it doesn't match. writeBlocks checks erased blocks in full, preserved
+    /// data included. Off by default. Only drivers built on writeBlocks, and the R4iSDHC (which checks
+    /// the written ranges), support it; for the others it's a no-op.
+    void setWriteVerify(bool verify) { m_verify_writes = verify; }
+    /// The erase block the last write's verification found a mismatch in; {0, 0} otherwise.
+    EraseBlock getVerifyFailure() const { return m_verify_failure; }
+
+    enum StepResult { STEP_MORE, STEP_DONE, STEP_FAILED };
+
+    /// writeSegments as a resumable operation, for hosts that run flashcart_core from an event loop rather
+    /// than blocking in it. After startWrite, each writeStep does one bounded piece of the write (reading a
+    /// block, starting an erase, a single busy poll while it runs, or programming up to WRITE_STEP_SIZE bytes)
+    /// and returns STEP_MORE until the write is done or has failed. In between, the host is free to do
+    /// anything except use flashcart_core. `segments` and their data must stay valid until then; starting
+    /// another write abandons it. Drivers not built on writeBlocks do the whole write in the first step.
+    virtual bool startWrite(const WriteSegment *segments, size_t count);
+    StepResult writeStep();
+
+    static const uint32_t WRITE_STEP_SIZE = 0x200;
+
 protected:
     const char* m_name;
     const size_t m_max_length;
+
+    // Read-modify-write engine. A driver that describes its erase blocks (eraseBlockAt) and implements the
+    // rmw* hooks can implement writeFlash as just `return writeBlocks(address, length, buffer);` (and
+    // writeSegments as `return writeBlocks(segments, count);`), and report WRITE_DIFFERENTIAL | WRITE_SKIPS_BLANK.
+
+    /// Reads flash for the engine (without reporting progress).
+    virtual bool rmwRead(uint32_t address, uint32_t length, uint8_t *buffer) { return false; }
+    /// Erases `block`.
+    virtual bool rmwErase(const EraseBlock &block) { return false; }
+    /// Starts erasing `block`, and rmwBusy says when it's done, so a resumable write can return while it
+    /// runs. Drivers whose erase is a single command and a busy poll implement these instead of rmwErase.
+    virtual bool rmwEraseStart(const EraseBlock &block);
+    /// Polls the erase started by rmwEraseStart once.
+    virtual bool rmwBusy() { return false; }
+    /// Programs the bytes of `data` that differ from `old`, which is what's currently at `address`.
+    /// `old` is null if the range has just been erased, i.e. the bytes that aren't 0xFF need
+    /// programming. Only ever asked to clear bits.
+    virtual bool rmwProgram(uint32_t address, uint32_t length, const uint8_t *data, const uint8_t *old) { return false; }
+    /// Whether rmwRead can be relied on to say what's on the flash. If not, writeBlocks doesn't skip
+    /// or program just the differences on the strength of it: every block is erased and programmed in full.
+    virtual bool rmwReadTrusted() { return true; }
+
+    /// Writes `buffer` one erase block at a time: every block is read back first, blocks that are
+    /// already identical are skipped, a block is only erased if a bit has to go from 0 to 1, and the
+    /// rest of a partially written block is preserved.
+    bool writeBlocks(uint32_t address, uint32_t length, const uint8_t *buffer) {
+        const WriteSegment segment = {address, length, buffer};
+        return writeBlocks(&segment, 1);
+    }
+    /// The same for a writeSegments list: all the segments in a block are merged into it before
+    /// deciding whether it needs erasing.
+    bool writeBlocks(const WriteSegment *segments, size_t count);
+    /// Sets up writeBlocks to be run by writeStep, programming at most `slice` bytes (0 for no limit)
+    /// per step. A driver built on writeBlocks implements startWrite as
+    /// `return startBlocks(segments, count);`.
+    bool startBlocks(const WriteSegment *segments, size_t count, uint32_t slice = WRITE_STEP_SIZE);
+
+    bool readCacheEnabled() const { return m_cache_max_lines != 0; }
+    /// Reads through the read cache (see setReadCache), filling it from rmwRead. Just rmwRead if it's off.
+    bool readCached(uint32_t address, uint32_t length, uint8_t *buffer, bool progress = false);
+    /// Call after changing flash other than through writeBlocks.
+    void invalidateReadCache(uint32_t address, uint32_t length);
+
+    bool verifyEnabled() const { return m_verify_writes; }
+    void resetVerifyFailure() { m_verify_failure = {0, 0}; }
+    /// Reads `length` bytes at `address` back through rmwRead (bypassing the read cache) and compares
+    /// them with `expected`. On a mismatch, logs it and records the erase block for getVerifyFailure.
+    /// Writes call resetVerifyFailure first, so a stale failure never outlives the next write.
+    bool verifyWrite(uint32_t address, uint32_t length, const uint8_t *expected);
+
+private:
+    struct CacheLine {
+        uint32_t address;
+        uint32_t last_use;
+        uint8_t *data;
+    };
+    std::vector<CacheLine> m_cache;
+    uint32_t m_cache_max_lines;
+    uint32_t m_cache_clock;
+    bool m_verify_writes;
+    EraseBlock m_verify_failure;
+
+    // writeBlocks' state between steps
+    struct WriteJob {
+        enum State { IDLE, SYNC, NEXT_BLOCK, ERASE_WAIT, PROGRAM } state;
+        const WriteSegment *segments;
+        size_t count;
+        uint32_t slice;
+        uint32_t total;
+        uint32_t done;
+        uint32_t address; // where the next block starts
+        EraseBlock eb;
+        size_t first, last; // the segments in eb
+        bool changed;
+        bool erased; // then the whole block is programmed from `block`
+        size_t part; // what's programmed next: segment and offset into its part, or offset into `block`
+        uint32_t offset;
+        uint8_t *block;
+        uint32_t block_size;
+    };
+    WriteJob m_job;
+
+    void resetJob();
+    void jobPart(size_t i, uint32_t &start, uint32_t &len) const;
+    StepResult blockStep();
+    StepResult programStep();
+    StepResult endBlock(bool ok);
+
+    CacheLine *findCacheLine(uint32_t address);
+    CacheLine *newCacheLine(uint32_t address);
+    void updateReadCache(uint32_t address, uint32_t length, const uint8_t *data);
 };
 
 extern std::vector<Flashcart*> *flashcart_list;
+
+// Wait points. Drivers wait on the cart through these rather than spinning or calling
+// platform::ioDelay directly, so the platform's yield hook (platform::yieldWait) runs
+// while the cart is busy. They return once the wait is over; nothing is suspended.
+const uint32_t WAIT_SLICE_US = 10000;
+
+/// Waits `us` microseconds, calling platform::yieldWait at least every WAIT_SLICE_US.
+void waitDelay(uint32_t us);
+
+/// Calls `ready` until it returns true, waiting `interval_us` (or just calling
+/// platform::yieldWait(0), if 0) between polls.
+/// Returns false if it still isn't ready after `max_polls` polls (0 = no limit).
+template <typename F>
+bool waitUntil(F ready, uint32_t max_polls = 0, uint32_t interval_us = 0) {
+    for (uint32_t polls = 1; !ready(); ++polls) {
+        if (max_polls && polls >= max_polls) {
+            return false;
+        }
+        if (interval_us) {
+            waitDelay(interval_us);
+        } else {
+            platform::yieldWait(0);
+        }
+    }
+    return true;
+}
+
+// Byte scrambling, as used by the R4i Gold and R4SDHC to "encrypt" their flash contents.
+
+/// A fixed permutation of the bits of a byte, optionally XORed with a constant before
+/// and after, applied through a 256 entry table that's built at compile time.
+class BytePermutation {
+    uint8_t m_lut[256];
+
+    constexpr BytePermutation() : m_lut() { }
+
+public:
+    /// Source bit i ends up in bit `dest[i]`; the input is XORed with `xor_in` before the
+    /// permutation and the result with `xor_out` after it.
+    constexpr BytePermutation(const uint8_t (&dest)[8], uint8_t xor_in = 0, uint8_t xor_out = 0) : m_lut() {
+        for (uint32_t v = 0; v < 256; ++v) {
+            const uint8_t in = static_cast<uint8_t>(v ^ xor_in);
+            uint8_t out = 0;
+            for (uint32_t i = 0; i < 8; ++i) {
+                if (in & BIT(i)) {
+                    out |= BIT(dest[i]);
+                }
+            }
+            m_lut[v] = out ^ xor_out;
+        }
+    }
+
+    /// The permutation that undoes this one (`dest` must not map two bits to the same one).
+    constexpr BytePermutation inverse() const {
+        BytePermutation inv;
+        for (uint32_t v = 0; v < 256; ++v) {
+            inv.m_lut[m_lut[v]] = static_cast<uint8_t>(v);
+        }
+        return inv;
+    }
+
+    constexpr uint8_t operator()(uint8_t b) const { return m_lut[b]; }
+
+    /// Applies the permutation to `length` bytes from `src` to `dst` (which may be the same buffer).
+    void apply(uint8_t *dst, const uint8_t *src, uint32_t length) const {
+        for (uint32_t i = 0; i < length; ++i) {
+            dst[i] = m_lut[src[i]];
+        }
+    }
+};
+
+/// XORs each byte with the low 8 bits of (its offset + `base`), starting at `offset`.
+/// Its own inverse.
+inline void applyOffsetXor(uint8_t *dst, const uint8_t *src, uint32_t length, uint32_t offset, uint8_t base) {
+    uint8_t key = static_cast<uint8_t>(offset + base);
+    for (uint32_t i = 0; i < length; ++i) {
+        dst[i] = src[i] ^ key++;
+    }
+}
 }
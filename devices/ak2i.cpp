@@ -1,11 +1,12 @@
 #include "device.h"
-#include "delay.h"
 
 #include <stdlib.h>
 #include <cstring>
+#include <algorithm>
 
 namespace flashcart_core {
 using ntrcard::sendCommand;
+using ntrcard::CommandBatch;
 using platform::logMessage;
 using platform::showProgress;
 
@@ -28,19 +29,40 @@ protected:
     static const uint32_t page_size = 0x10000;
 
     uint32_t m_ak2i_hwrevision;
+    // bytes per read command, as probed by initialize()
+    uint32_t m_read_size;
+    // whether the cart is known to be in flash write mode, so a2ki_write_mode can be skipped
+    bool m_write_mode;
+
+    CommandBatch m_batch;
+
+    bool a2ki_flash_busy() {
+        uint32_t state;
+        // I've been trying to get down to the bottom of this delay for a while
+        // hopefully soon it will no longer be needed.
+        // ioDelay( 16 * 10 );
+        sendCommand(ak2i_cmdWaitFlashBusy, 4, (uint8_t *)&state, 4);
+        logMessage(LOG_DEBUG, "AK2i: waitFlashBusy = 0x%08x", state);
+        return (state & 1) != 0;
+    }
 
     void a2ki_wait_flash_busy() {
+        waitUntil([this] { return !a2ki_flash_busy(); });
+    }
+
+    // sends everything queued in m_batch plus cmdbuf, with the first busy poll right behind it
+    void a2ki_send_wait_flash_busy(const uint8_t *cmdbuf, ntrcard::OpFlags flags) {
         uint32_t state;
-        do {
-            // I've been trying to get down to the bottom of this delay for a while
-            // hopefully soon it will no longer be needed.
-            // ioDelay( 16 * 10 );
-            sendCommand(ak2i_cmdWaitFlashBusy, 4, (uint8_t *)&state, 4);
-            logMessage(LOG_DEBUG, "AK2i: waitFlashBusy = 0x%08x", state);
-        } while ((state & 1) != 0);
+        m_batch.add(cmdbuf, 0, nullptr, flags);
+        m_batch.add(ak2i_cmdWaitFlashBusy, 4, (uint8_t *)&state, 4);
+        m_batch.send();
+        logMessage(LOG_DEBUG, "AK2i: waitFlashBusy = 0x%08x", state);
+        if ((state & 1) != 0)
+            a2ki_wait_flash_busy();
     }
 
-    void a2ki_read(uint8_t *outbuf, uint32_t address) {
+    // queued in m_batch, outbuf is filled in once it's sent
+    void a2ki_read(uint8_t *outbuf, uint32_t address, uint16_t length = 0x200) {
         uint8_t cmdbuf[8];
         logMessage(LOG_DEBUG, "AK2i: read(0x%08x)", address);
         memcpy(cmdbuf, ak2i_cmdReadFlash, 8);
@@ -49,10 +71,11 @@ protected:
         cmdbuf[3] = (address >>  8) & 0xFF;
         cmdbuf[4] = (address >>  0) & 0xFF;
 
-        sendCommand(cmdbuf, 0x200, outbuf, 2);
+        m_batch.add(cmdbuf, length, outbuf, 2);
         // a2ki_wait_flash_busy();
     }
 
+    // sends everything queued in m_batch plus the erase, without waiting for it (see rmwBusy)
     void a2ki_erase(uint32_t address) {
         uint8_t cmdbuf[8];
 
@@ -71,8 +94,8 @@ protected:
         cmdbuf[2] = (address >>  8) & 0xFF;
         cmdbuf[3] = (address >>  0) & 0xFF;
 
-        sendCommand(cmdbuf, 0, nullptr, (m_ak2i_hwrevision == 0x81818181) ? 20 : 0 );
-        a2ki_wait_flash_busy();
+        m_batch.add(cmdbuf, 0, nullptr, (m_ak2i_hwrevision == 0x81818181) ? 20 : 0);
+        m_batch.send();
     }
 
     void a2ki_writebyte(uint32_t address, uint8_t value) {
@@ -94,12 +117,126 @@ protected:
         cmdbuf[3] = (address >>  0) & 0xFF;
         cmdbuf[4] = value;
 
-        sendCommand(cmdbuf, 0, nullptr, 20);
-        a2ki_wait_flash_busy();
+        a2ki_send_wait_flash_busy(cmdbuf, 20);
+    }
+
+    // queues the commands that put the cart in flash read mode
+    void a2ki_read_mode() {
+        m_write_mode = false;
+        m_batch.add(ak2i_cmdLockFlash, 0, nullptr, 0);
+        if (m_ak2i_hwrevision == 0x81818181) m_batch.add(ak2i_cmdSetFlash1681_81, 0, nullptr, 20);
+        m_batch.add(ak2i_cmdSetMapTableAddress, 0, nullptr, 0);
+    }
+
+    // puts the cart in flash write mode, unless nothing has taken it out since the last time
+    void a2ki_write_mode() {
+        if (m_write_mode) return;
+        m_write_mode = true;
+        m_batch.add(ak2i_cmdUnlockFlash, 0, nullptr, 0);
+        m_batch.add(ak2i_cmdUnlockASIC, 0, nullptr, 0);
+        if (m_ak2i_hwrevision == 0x81818181) m_batch.add(ak2i_cmdSetFlash1681_81, 0, nullptr, 20);
+        m_batch.add(ak2i_cmdSetMapTableAddress, 0, nullptr, 0);
+        m_batch.send();
+    }
+
+    // The ASIC is only known to honour 0x200 byte reads. Larger ones are checked against those once,
+    // at a few places that aren't a constant fill, and the largest one that matches is used from then on.
+    // Only called from initialize(), so nothing else ever issues reads just to learn the size.
+    void a2ki_probe_read_size() {
+        static const uint32_t sizes[] = {0x1000, 0x800, 0x400};
+        static const uint32_t probe_addresses[] = {0, 0x10000, 0x80000, 0x100000};
+
+        m_read_size = 0x200;
+        uint8_t *ref = (uint8_t *)malloc(sizes[0] * 2);
+        if (!ref) {
+            return;
+        }
+        uint8_t *buf = ref + sizes[0];
+
+        for (uint32_t address : probe_addresses) {
+            a2ki_read_mode();
+            for (uint32_t curpos=0; curpos < sizes[0]; curpos+=0x200) {
+                a2ki_read(ref + curpos, address + curpos);
+            }
+            m_batch.send();
+            if (std::all_of(ref, ref + sizes[0], [ref](uint8_t b) { return b == ref[0]; })) {
+                continue;
+            }
+
+            for (uint32_t size : sizes) {
+                memset(buf, 0, size);
+                a2ki_read_mode();
+                a2ki_read(buf, address, size);
+                m_batch.send();
+                if (!memcmp(ref, buf, size)) {
+                    m_read_size = size;
+                    break;
+                }
+            }
+            break;
+        }
+
+        free(ref);
+        logMessage(LOG_INFO, "AK2i: reading 0x%x bytes per command", m_read_size);
+    }
+
+    void a2ki_read_range(uint32_t address, uint32_t length, uint8_t *buffer, bool progress) {
+        const uint32_t read_size = m_read_size;
+        uint8_t tail[0x200];
+
+        a2ki_read_mode();
+        for (uint32_t curpos=0; curpos < length;) {
+            if (length - curpos >= read_size && (address + curpos) % read_size == 0) {
+                a2ki_read(buffer + curpos, address + curpos, read_size);
+                curpos += read_size;
+            } else if (length - curpos >= 0x200) {
+                a2ki_read(buffer + curpos, address + curpos);
+                curpos += 0x200;
+            } else {
+                a2ki_read(tail, address + curpos);
+                m_batch.send();
+                memcpy(buffer + curpos, tail, length - curpos);
+                curpos = length;
+            }
+
+            if (m_batch.size() >= 0x10) {
+                m_batch.send();
+                if (progress) showProgress(curpos, length, "Reading");
+            }
+        }
+        m_batch.send();
+    }
+
+    EraseBlock eraseBlockAt(uint32_t address) {
+        if (address >= getMaxLength()) return {address, 0};
+        return {PAGE_ROUND_DOWN(address, page_size), page_size};
+    }
+
+    bool rmwRead(uint32_t address, uint32_t length, uint8_t *buffer) {
+        a2ki_read_range(address, length, buffer, false);
+        return true;
+    }
+
+    bool rmwEraseStart(const EraseBlock &block) {
+        a2ki_write_mode();
+        a2ki_erase(block.address);
+        return true;
+    }
+
+    bool rmwBusy() {
+        return a2ki_flash_busy();
+    }
+
+    bool rmwProgram(uint32_t address, uint32_t length, const uint8_t *data, const uint8_t *old) {
+        a2ki_write_mode();
+        for (uint32_t i=0; i < length; i++) {
+            if (data[i] != (old ? old[i] : 0xFF)) a2ki_writebyte(address + i, data[i]);
+        }
+        return true;
     }
 
 public:
-    AK2i() : Flashcart("Acekard 2i", 0x200000) { }
+    AK2i() : Flashcart("Acekard 2i", 0x200000), m_read_size(0x200), m_write_mode(false) { }
 
     const char *getAuthor() { return "Kitlith + Normmatt"; }
     const char *getDescription() { return "Works with the following carts:\n * Acekard 2i HW-44\n * Acekard 2i HW-81\n * R4i Ultra (r4ultra.com)"; }
@@ -111,30 +248,39 @@ public:
         return 0x0;
     }
 
+    uint32_t getReadChunkSize() { return m_read_size; }
+    uint32_t getWriteFlags() { return WRITE_DIFFERENTIAL | WRITE_SKIPS_BLANK; }
+
     bool initialize()
     {
         uint8_t garbage[4];
         logMessage(LOG_INFO, "AK2i: Init");
         sendCommand(ak2i_cmdGetHWRevision, 4, (uint8_t*)&m_ak2i_hwrevision, 0);
         logMessage(LOG_NOTICE, "AK2i: HW Revision = %08x", m_ak2i_hwrevision);
+        m_read_size = 0x200;
+        m_write_mode = false;
 
         if (m_ak2i_hwrevision == 0x44444444)
         {
-            sendCommand(ak2i_cmdSetMapTableAddress, 0, nullptr, 0);
-            sendCommand(ak2i_cmdActiveFatMap, 4, garbage, 0);
-            sendCommand(ak2i_cmdUnlockASIC, 0, nullptr, 0);
+            m_batch.add(ak2i_cmdSetMapTableAddress, 0, nullptr, 0);
+            m_batch.add(ak2i_cmdActiveFatMap, 4, garbage, 0);
+            m_batch.add(ak2i_cmdUnlockASIC, 0, nullptr, 0);
         }
         else if (m_ak2i_hwrevision == 0x81818181)
         {
-            sendCommand(ak2i_cmdSetFlash1681_81, 0, nullptr, 20);
-            sendCommand(ak2i_cmdActiveFatMap, 4, garbage, 0);
-            sendCommand(ak2i_cmdUnlockFlash, 0, nullptr, 0);
-            sendCommand(ak2i_cmdUnlockASIC, 0, nullptr, 0);
-            sendCommand(ak2i_cmdSetMapTableAddress, 0, nullptr, 0);
+            m_batch.add(ak2i_cmdSetFlash1681_81, 0, nullptr, 20);
+            m_batch.add(ak2i_cmdActiveFatMap, 4, garbage, 0);
+            m_batch.add(ak2i_cmdUnlockFlash, 0, nullptr, 0);
+            m_batch.add(ak2i_cmdUnlockASIC, 0, nullptr, 0);
+            m_batch.add(ak2i_cmdSetMapTableAddress, 0, nullptr, 0);
         } else {
             return false;
         }
 
+        if (!m_batch.send()) {
+            return false;
+        }
+        a2ki_probe_read_size();
         return true;
     }
 
@@ -142,75 +288,54 @@ public:
     {
         uint8_t garbage[4];
         logMessage(LOG_INFO, "AK2i: Shutdown");
-        sendCommand(ak2i_cmdLockFlash, 0, nullptr, 0);
-        sendCommand(ak2i_cmdSetMapTableAddress, 0, nullptr, 0);
-        sendCommand(ak2i_cmdActiveFatMap, 4, garbage, 4);
+        m_write_mode = false;
+        m_batch.add(ak2i_cmdLockFlash, 0, nullptr, 0);
+        m_batch.add(ak2i_cmdSetMapTableAddress, 0, nullptr, 0);
+        m_batch.add(ak2i_cmdActiveFatMap, 4, garbage, 4);
+        m_batch.send();
     }
 
     bool readFlash(uint32_t address, uint32_t length, uint8_t *buffer)
     {
-        logMessage(LOG_INFO, "AK2i: readFlash(addr=0x%08x, size=0x%x)");
-        sendCommand(ak2i_cmdLockFlash, 0, nullptr, 0);
-
-        if (m_ak2i_hwrevision == 0x81818181) sendCommand(ak2i_cmdSetFlash1681_81, 0, nullptr, 20);
-        sendCommand(ak2i_cmdSetMapTableAddress, 0, nullptr, 0);
-
-        for (uint32_t curpos=0; curpos < length; curpos+=0x200) {
-            a2ki_read(buffer + curpos, address + curpos);
-            showProgress(curpos+1,length, "Reading");
-        }
-
+        logMessage(LOG_INFO, "AK2i: readFlash(addr=0x%08x, size=0x%x)", address, length);
+        if (readCacheEnabled()) return readCached(address, length, buffer, true);
+        a2ki_read_range(address, length, buffer, true);
         return true;
     }
 
     bool writeFlash(uint32_t address, uint32_t length, const uint8_t *buffer)
     {
-        logMessage(LOG_INFO, "AK2i: writeFlash(addr=0x%08x, size=0x%x)");
-        sendCommand(ak2i_cmdUnlockFlash, 0, nullptr, 0);
-        sendCommand(ak2i_cmdUnlockASIC, 0, nullptr, 0);
-
-        if (m_ak2i_hwrevision == 0x81818181) sendCommand(ak2i_cmdSetFlash1681_81, 0, nullptr, 20);
-        sendCommand(ak2i_cmdSetMapTableAddress, 0, nullptr, 0);
-
-        for (uint32_t addr=0; addr < length; addr+=page_size)
-        {
-            a2ki_erase(address + addr);
+        logMessage(LOG_INFO, "AK2i: writeFlash(addr=0x%08x, size=0x%x)", address, length);
+        return writeBlocks(address, length, buffer);
+    }
 
-            for (uint32_t i=0; i < page_size; i++) {
-                a2ki_writebyte(address + addr + i, buffer[addr + i]);
-                showProgress(addr+i+1,length, "Writing");
-            }
-        }
+    bool writeSegments(const WriteSegment *segments, size_t count)
+    {
+        return writeBlocks(segments, count);
+    }
 
-        return true;
+    bool startWrite(const WriteSegment *segments, size_t count)
+    {
+        return startBlocks(segments, count);
     }
 
     bool injectNtrBoot(uint8_t *blowfish_key, uint8_t *firm, uint32_t firm_size)
     {
-        // This function follows a read-modify-write cycle:
-        //  - Read from flash to prevent accidental erasure of things not overwritten
-        //  - Modify the data read, mostly by memcpying data in, perhaps 'encrypting' it first.
-        //  - Write the data back to flash, now that we have made our modifications.
+        // The key, chip ID and FIRM all land in the first blocks after 0x80000; writeSegments
+        // reads those back, merges the three in and erases and programs each block once.
         const uint32_t blowfish_adr = 0x80000;
         const uint32_t firm_offset = 0x9E00;
         const uint32_t chipid_offset = 0x1FC0;
 
-        uint32_t buf_size = PAGE_ROUND_UP(firm_offset + firm_size, page_size);
-        uint8_t *buf = (uint8_t *)calloc(buf_size, sizeof(uint8_t));
+        static const uint8_t chipid_and_length[8] = {0x00, 0x00, 0x0F, 0xC2, 0x00, 0xB4, 0x17, 0x00};
+        const WriteSegment segments[] = {
+            {blowfish_adr, 0x1048, blowfish_key},
+            {blowfish_adr + chipid_offset, 8, chipid_and_length},
+            {blowfish_adr + firm_offset, firm_size, firm},
+        };
 
         logMessage(LOG_INFO, "AK2i: Injecting Ntrboot");
-        readFlash(blowfish_adr, buf_size, buf); // Read in data that shouldn't be changed
-        memcpy(buf, blowfish_key, 0x1048);
-        memcpy(buf + firm_offset, firm, firm_size);
-
-        uint8_t chipid_and_length[8] = {0x00, 0x00, 0x0F, 0xC2, 0x00, 0xB4, 0x17, 0x00};
-        memcpy(buf + chipid_offset, chipid_and_length, 8);
-
-        writeFlash(blowfish_adr, buf_size, buf);
-
-        free(buf);
-
-        return true;
+        return writeSegments(segments, 3);
     }
 };
 
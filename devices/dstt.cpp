@@ -56,6 +56,9 @@ Supported but untested, non standard flash commands:
     0x9689: INTEL 28F320B3T (can't find specific datasheet)
     0x9789: INTEL 28F320B3B (can't find specific datasheet)
 
+Chips that aren't listed above are still used if they answer a CFI query (0x55:0x98),
+taking the command set, erase regions and timeouts from that. Listed chips aren't queried.
+
 Known flashchips that are "unsupported":
     0x0B8A "DSTTi :P"
     0x23AD "BRIGHT MICRO. BM29LV400T"
@@ -96,9 +99,12 @@ Known flashchips that are "unsupported":
 
 #include <stdlib.h>
 #include <cstring>
+#include <algorithm>
+#include <utility>
 
 namespace flashcart_core {
 using ntrcard::sendCommand;
+using ntrcard::CommandBatch;
 using platform::logMessage;
 using platform::showProgress;
 
@@ -124,9 +130,32 @@ private:
         DSTT_CMD_TYPE_2
     } m_cmd_type;
 
-    uint32_t dstt_flash_command(uint8_t data0, uint32_t data1, uint16_t data2)
+    // erase block sizes, see get_sector_map
+    std::vector<uint32_t> m_sectors;
+
+    // type 1 chips that can program in two cycles (0xA0, data) after entering unlock bypass mode
+    bool m_unlock_bypass;
+
+    uint32_t m_program_max_polls;
+    uint32_t m_erase_max_polls;
+
+    // What the chip's CFI query table says, in the same units as the sector maps.
+    struct CfiInfo {
+        uint32_t flashchip;
+        bool valid;
+        bool amd; // primary command set is AMD/Fujitsu (type 1) rather than Intel (type 2)
+        std::vector<uint32_t> sectors; // covering m_max_length, see get_sector_map
+        uint32_t program_max_us; // 0 if not given
+        uint32_t erase_max_ms;
+    };
+
+    // CFI results by flashchip, so it's only queried the first time a chip is seen
+    std::vector<CfiInfo> m_cfi_cache;
+
+    CommandBatch m_batch;
+
+    static void dstt_flash_cmdbuf(uint8_t (&cmd)[8], uint8_t data0, uint32_t data1, uint16_t data2)
     {
-        uint8_t cmd[8];
         cmd[0] = data0;
         cmd[1] = (uint8_t)((data1 >> 24)&0xFF);
         cmd[2] = (uint8_t)((data1 >> 16)&0xFF);
@@ -135,6 +164,12 @@ private:
         cmd[5] = (uint8_t)((data2 >>  8)&0xFF);
         cmd[6] = (uint8_t)((data2 >>  0)&0xFF);
         cmd[7] = 0x00;
+    }
+
+    uint32_t dstt_flash_command(uint8_t data0, uint32_t data1, uint16_t data2)
+    {
+        uint8_t cmd[8];
+        dstt_flash_cmdbuf(cmd, data0, data1, data2);
 
         uint32_t ret;
 
@@ -142,6 +177,14 @@ private:
         return ret;
     }
 
+    // queues the command in a batch instead; the response (if wanted) is in resp after batch.send()
+    void dstt_flash_command(CommandBatch &batch, uint8_t data0, uint32_t data1, uint16_t data2, uint8_t *resp = nullptr)
+    {
+        uint8_t cmd[8];
+        dstt_flash_cmdbuf(cmd, data0, data1, data2);
+        batch.add(cmd, 4, resp, 0xa7180000);
+    }
+
     void dstt_reset()
     {
         logMessage(LOG_DEBUG, "DSTT: Reset");
@@ -156,19 +199,22 @@ private:
     {
         uint32_t flashchip;
 
-        dstt_flash_command(0x87, 0x5555, 0xAA);
-        dstt_flash_command(0x87, 0x2AAA, 0x55);
-        dstt_flash_command(0x87, 0x5555, 0x90);
-        flashchip = dstt_flash_command(0, 0, 0);
+        dstt_flash_command(m_batch, 0x87, 0x5555, 0xAA);
+        dstt_flash_command(m_batch, 0x87, 0x2AAA, 0x55);
+        dstt_flash_command(m_batch, 0x87, 0x5555, 0x90);
+        dstt_flash_command(m_batch, 0, 0, 0, (uint8_t*)&flashchip);
+        m_batch.send();
         dstt_reset();
 
         if ((flashchip & 0xFF00FFFF) != 0x7F003437 && (flashchip & 0xFF00FFFF) != 0x7F00B537
               && (uint16_t)flashchip != 0x41F && (uint16_t)flashchip != 0x51F)
         {
-            dstt_flash_command(0x87, 0x5555, 0xAA);
-            dstt_flash_command(0x87, 0x2AAA, 0x55);
-            dstt_flash_command(0x87, 0x5555, 0x90);
-            uint32_t device_id = dstt_flash_command(0, 0x100, 0);
+            uint32_t device_id;
+            dstt_flash_command(m_batch, 0x87, 0x5555, 0xAA);
+            dstt_flash_command(m_batch, 0x87, 0x2AAA, 0x55);
+            dstt_flash_command(m_batch, 0x87, 0x5555, 0x90);
+            dstt_flash_command(m_batch, 0, 0x100, 0, (uint8_t*)&device_id);
+            m_batch.send();
             dstt_reset();
 
             if ((uint16_t)device_id == 0xBA1C || (uint16_t)device_id == 0xB91C)
@@ -178,6 +224,88 @@ private:
         return flashchip;
     }
 
+    // CFI query: 0x98 at 0x55, after which the query table is readable from 0x10 like any other data.
+    // Works on both command sets. Query mode is left with the reset for the command set the table
+    // reports: 0xFF for Intel, 0xF0 for AMD (also used when there's no table, as the chip already
+    // answered the AMD autoselect sequence in get_flashchip_id).
+    CfiInfo cfi_query(uint32_t flashchip)
+    {
+        CfiInfo info = {flashchip, false, false, {}, 0, 0};
+        uint8_t q[0x60];
+
+        dstt_flash_command(m_batch, 0x87, 0x55, 0x98);
+        for (uint32_t i = 0x10; i < sizeof(q); i += 4)
+            dstt_flash_command(m_batch, 0, i, 0, q + i);
+        m_batch.send();
+
+        const bool has_cfi = q[0x10] == 'Q' && q[0x11] == 'R' && q[0x12] == 'Y';
+        const uint16_t cmd_set = has_cfi ? q[0x13] | (q[0x14] << 8) : 0;
+        dstt_flash_command(0x87, 0, (cmd_set == 0x0001 || cmd_set == 0x0003) ? 0xFF : 0xF0);
+
+        if (!has_cfi) {
+            logMessage(LOG_INFO, "DSTT: no CFI");
+            return info;
+        }
+
+        if (cmd_set != 0x0001 && cmd_set != 0x0002 && cmd_set != 0x0003) {
+            logMessage(LOG_WARN, "DSTT: CFI: unknown command set 0x%04x", cmd_set);
+            return info;
+        }
+        info.amd = cmd_set == 0x0002;
+
+        // typical times are 2^n us (program) / ms (erase), maximums are 2^n times the typical
+        if (q[0x1F] && q[0x23])
+            info.program_max_us = 1u << std::min(q[0x1F] + q[0x23], 24);
+        if (q[0x21] && q[0x25])
+            info.erase_max_ms = 1u << std::min(q[0x21] + q[0x25], 24);
+
+        const uint8_t num_regions = q[0x2C];
+        if (num_regions == 0 || 0x2Du + num_regions * 4u > sizeof(q)) {
+            logMessage(LOG_WARN, "DSTT: CFI: bad erase region count %u", num_regions);
+            return info;
+        }
+
+        std::vector<std::pair<uint32_t, uint32_t>> regions; // (blocks, block size)
+        for (uint8_t i = 0; i < num_regions; ++i) {
+            const uint8_t *r = q + 0x2D + i * 4;
+            const uint32_t block_sz = (r[2] | (r[3] << 8)) * 0x100;
+            regions.emplace_back((r[0] | (r[1] << 8)) + 1, block_sz ? block_sz : 0x80);
+        }
+
+        // AMD top boot parts list their regions from the top (primary extended table v1.1+, boot flag 3)
+        const uint16_t ext = q[0x15] | (q[0x16] << 8);
+        if (info.amd && ext && ext + 0xFu < sizeof(q) && !memcmp(q + ext, "PRI", 3) &&
+              q[ext + 3] == '1' && q[ext + 4] >= '1' && q[ext + 0xF] == 3)
+            std::reverse(regions.begin(), regions.end());
+
+        uint32_t total = 0;
+        for (auto const& region: regions) {
+            for (uint32_t i = 0; i < region.first && total < m_max_length; ++i) {
+                info.sectors.push_back(region.second);
+                total += region.second;
+            }
+        }
+        if (total < m_max_length) {
+            logMessage(LOG_WARN, "DSTT: CFI: erase regions only cover 0x%x bytes", total);
+            return info;
+        }
+
+        logMessage(LOG_INFO, "DSTT: CFI: command set %u, %u erase regions, max program %uus, max erase %ums, write buffer %u bytes",
+            cmd_set, num_regions, info.program_max_us, info.erase_max_ms, (q[0x2A] | (q[0x2B] << 8)) ? 1u << (q[0x2A] | (q[0x2B] << 8)) : 0);
+        info.valid = true;
+        return info;
+    }
+
+    const CfiInfo &get_cfi_info(uint32_t flashchip)
+    {
+        for (auto const& info: m_cfi_cache)
+            if (info.flashchip == flashchip)
+                return info;
+
+        m_cfi_cache.push_back(cfi_query(flashchip));
+        return m_cfi_cache.back();
+    }
+
     bool flashchip_supported(uint32_t flashchip)
     {
         for (unsigned int i = 0; i < sizeof(supported_flashchips) / 2; ++i)
@@ -187,59 +315,122 @@ private:
         return false;
     }
 
-    void Erase_Block(uint32_t offset, uint32_t length)
+    // Status polls before an operation is considered stuck. Programs are polled back to back
+    // (they take microseconds), erases once a millisecond for up to 20s, unless CFI says otherwise.
+    static const uint32_t default_program_max_polls = 0x1000;
+    static const uint32_t default_erase_max_polls = 20000;
+    static const uint32_t erase_poll_interval = 1000;
+
+    // Waits for the embedded program/erase algorithm of a type 1 chip to finish, using data polling:
+    // DQ7 reads as the complement of `expected` until it's done. `status` is a read of `offset` already
+    // made after the command. If the chip sets DQ5 (exceeded its timing limit), the toggle bit (DQ6)
+    // decides whether it finished after all or failed.
+    bool Wait_Type1(uint32_t offset, uint8_t expected, uint8_t status, uint32_t max_polls, uint32_t interval_us)
     {
-        logMessage(LOG_DEBUG, "DSTT: erase_block(0x%08x)", offset);
-        if (m_cmd_type == DSTT_CMD_TYPE_1) {
-            dstt_flash_command(0x87, 0x5555, 0xAA);
-            dstt_flash_command(0x87, 0x2AAA, 0x55);
-            dstt_flash_command(0x87, 0x5555, 0x80);
-            dstt_flash_command(0x87, 0x5555, 0xAA);
-            dstt_flash_command(0x87, 0x2AAA, 0x55);
-
-            dstt_flash_command(0x87, offset, 0x30);
-        } else if (m_cmd_type == DSTT_CMD_TYPE_2) {
-            dstt_flash_command(0x87, 0x00,   0x50); // Clear Status Register
-            dstt_flash_command(0x87, offset, 0x20); // Erase Setup
-            dstt_flash_command(0x87, offset, 0xD0); // Erase Confirm
+        bool first = true;
+        bool failed = false;
+        bool done = waitUntil([&] {
+            if (!first)
+                status = dstt_flash_command(0, offset, 0);
+            first = false;
+
+            if (!((status ^ expected) & 0x80))
+                return true;
+            if (status & 0x20) {
+                uint8_t toggle = dstt_flash_command(0, offset, 0) ^ dstt_flash_command(0, offset, 0);
+                failed = (toggle & 0x40) != 0;
+                return true;
+            }
+            return false;
+        }, max_polls, interval_us);
 
-            // TODO: Timeout if something goes wrong.
-            while (!(dstt_flash_command(0, offset & 0xFFFFFFFC, 0) & 0x80));
+        if (!done || failed) {
+            logMessage(LOG_ERR, "DSTT: flash %s at 0x%08x (status 0x%02x)", done ? "reported failure" : "timed out", offset, status);
+            dstt_reset();
+            return false;
+        }
+        return true;
+    }
 
+    // Same for type 2 chips, which have a status register: SR7 is ready, SR5/SR4/SR3/SR1 are erase, program,
+    // VPP and lock errors. Leaves the chip in status mode.
+    bool Wait_Type2(uint32_t offset, uint32_t status, uint32_t max_polls, uint32_t interval_us)
+    {
+        bool first = true;
+        bool done = waitUntil([&] {
+            if (!first)
+                status = dstt_flash_command(0, offset & 0xFFFFFFFC, 0);
+            first = false;
+            return (status & 0x80) != 0;
+        }, max_polls, interval_us);
+
+        if (!done || (status & 0x3A)) {
+            logMessage(LOG_ERR, "DSTT: flash %s at 0x%08x (status 0x%02x)", done ? "reported failure" : "timed out", offset, status & 0xFF);
             dstt_flash_command(0x87, 0x00, 0x50); // Clear Status Register
-            dstt_flash_command(0x87, 0x00, 0xFF); // Reset
+            dstt_reset();
+            return false;
         }
+        return true;
+    }
 
-        uint32_t end_offset = offset + length;
-        for (; offset < end_offset; offset += 4)
-        {
-            // TODO: Timeout if something goes wrong.
-            while (dstt_flash_command(0, offset, 0) != 0xFFFFFFFF);
+    bool Erase_Block(uint32_t offset)
+    {
+        logMessage(LOG_DEBUG, "DSTT: erase_block(0x%08x)", offset);
+        uint32_t status = 0;
+        bool ret = false;
+        if (m_cmd_type == DSTT_CMD_TYPE_1) {
+            dstt_flash_command(m_batch, 0x87, 0x5555, 0xAA);
+            dstt_flash_command(m_batch, 0x87, 0x2AAA, 0x55);
+            dstt_flash_command(m_batch, 0x87, 0x5555, 0x80);
+            dstt_flash_command(m_batch, 0x87, 0x5555, 0xAA);
+            dstt_flash_command(m_batch, 0x87, 0x2AAA, 0x55);
+
+            dstt_flash_command(m_batch, 0x87, offset, 0x30);
+            dstt_flash_command(m_batch, 0, offset, 0, (uint8_t*)&status);
+            m_batch.send();
+
+            ret = Wait_Type1(offset, 0xFF, status, m_erase_max_polls, erase_poll_interval);
+        } else if (m_cmd_type == DSTT_CMD_TYPE_2) {
+            dstt_flash_command(m_batch, 0x87, 0x00,   0x50); // Clear Status Register
+            dstt_flash_command(m_batch, 0x87, offset, 0x20); // Erase Setup
+            dstt_flash_command(m_batch, 0x87, offset, 0xD0); // Erase Confirm
+            dstt_flash_command(m_batch, 0, offset & 0xFFFFFFFC, 0, (uint8_t*)&status);
+            m_batch.send();
+
+            ret = Wait_Type2(offset, status, m_erase_max_polls, erase_poll_interval);
+            if (ret) {
+                dstt_flash_command(m_batch, 0x87, 0x00, 0x50); // Clear Status Register
+                dstt_flash_command(m_batch, 0x87, 0x00, 0xFF); // Reset
+                m_batch.send();
+            }
         }
+
+        return ret;
     }
 
-    void Erase_Chip() {
-        std::vector<uint32_t> erase_blocks;
-        logMessage(LOG_INFO, "DSTT: Erasing Flash");
+    // Erase block sizes from the start of the chip, covering m_max_length.
+    static std::vector<uint32_t> get_sector_map(uint32_t flashchip)
+    {
+        std::vector<uint32_t> sectors;
 
-        switch(m_flashchip)
+        switch(flashchip)
         {
             case 0x041F:
             case 0x9089:
             case 0xA01F:
             case 0xA31F:
             case 0xB91C:
-                erase_blocks = {0x10000};
+                sectors = {0x10000};
                 break;
 
             case 0x051F:
-                erase_blocks = {0x4000, 0x2000, 0x2000, 0x8000};
+                sectors = {0x4000, 0x2000, 0x2000, 0x8000};
                 break;
 
             case 0x80BF:
             case 0xC11F:
             case 0xC31F:
-                erase_blocks = std::vector<uint32_t>(0x20, 0x800);
+                sectors = std::vector<uint32_t>(0x20, 0x800);
                 break;
 
             case 0x1A37:
@@ -248,7 +439,7 @@ private:
             case 0xC298:
             case 0xC420:
             case 0xC4C2:
-                erase_blocks = {0x8000, 0x2000, 0x2000, 0x4000};
+                sectors = {0x8000, 0x2000, 0x2000, 0x4000};
                 break;
 
             case 0x49B0:
@@ -259,15 +450,15 @@ private:
             case 0x9389:
             case 0x9589:
             case 0x9789:
-                erase_blocks = std::vector<uint32_t>(9, 0x1000);
-                erase_blocks[8] = 0x8000;
+                sectors = std::vector<uint32_t>(9, 0x1000);
+                sectors[8] = 0x8000;
                 break;
 
             case 0x9289:
             case 0x9489:
             case 0x9689:
-                erase_blocks = std::vector<uint32_t>(9, 0x1000);
-                erase_blocks[0] = 0x8000;
+                sectors = std::vector<uint32_t>(9, 0x1000);
+                sectors[0] = 0x8000;
                 break;
 
             case 0x49C2:
@@ -285,47 +476,151 @@ private:
             case 0xEE20:
             case 0xEF20:
             default:
-                erase_blocks = {0x2000, 0x1000, 0x1000, 0x4000, 0x8000};
+                sectors = {0x2000, 0x1000, 0x1000, 0x4000, 0x8000};
                 break;
         }
 
-        // calculate the max so we can show progress
-        uint32_t erase_endaddr = 0;
-        for (auto const& block_sz: erase_blocks) {
-            erase_endaddr += block_sz;
+        return sectors;
+    }
+
+    static bool supports_unlock_bypass(uint32_t flashchip)
+    {
+        switch (flashchip) {
+            case 0x49C2: // Macronix MX29LV160/800/400/320
+            case 0x5BC2:
+            case 0xA7C2:
+            case 0xA8C2:
+            case 0xBAC2:
+            case 0xC4C2:
+            case 0xB91C: // EON EN29LV400
+            case 0xBA1C:
+            case 0xBA01: // Spansion Am29LV400B
+            case 0xBA04: // Fujitsu MBM29LV400
+                return true;
+            default:
+                return false;
         }
+    }
+
+    // Call around a run of Program_Byte. Enters unlock bypass mode on chips that have it.
+    void Program_Begin()
+    {
+        if (m_cmd_type == DSTT_CMD_TYPE_1 && m_unlock_bypass) {
+            dstt_flash_command(m_batch, 0x87, 0x5555, 0xAA);
+            dstt_flash_command(m_batch, 0x87, 0x2AAA, 0x55);
+            dstt_flash_command(m_batch, 0x87, 0x5555, 0x20); // Unlock Bypass
+            m_batch.send();
+        }
+    }
 
-        uint32_t erase_addr = 0;
-        for (auto const& block_sz: erase_blocks) {
-            showProgress(erase_addr, erase_endaddr, "Erasing Blocks");
-            Erase_Block(erase_addr, block_sz);
-            erase_addr += block_sz;
+    void Program_End()
+    {
+        if (m_cmd_type == DSTT_CMD_TYPE_1 && m_unlock_bypass) {
+            dstt_flash_command(m_batch, 0x87, 0x00, 0x90); // Unlock Bypass Reset
+            dstt_flash_command(m_batch, 0x87, 0x00, 0x00);
+            m_batch.send();
         }
+        dstt_reset();
     }
 
-    // pretty messy function, but gets the job done
-    void Program_Byte(uint32_t offset, uint8_t data)
+    bool Program_Byte(uint32_t offset, uint8_t data)
     {
         logMessage(LOG_DEBUG, "DSTT: program_byte(0x%08x) = 0x%02x", offset, data);
+        uint32_t status = 0;
         if (m_cmd_type == DSTT_CMD_TYPE_2) {
-            dstt_flash_command(0x87, 0x00,   0x50); // Clear Status Register
-            dstt_flash_command(0x87, offset, 0x40); // Word Write
-            dstt_flash_command(0x87, offset, data);
-
-            // TODO: Timeout if something goes wrong.
-            while (!(dstt_flash_command(0, offset & 0xFFFFFFFC, 0) & 0x80));
+            // the status register is only cleared (by Wait_Type2) if something went wrong
+            dstt_flash_command(m_batch, 0x87, offset, 0x40); // Word Write
+            dstt_flash_command(m_batch, 0x87, offset, data);
+            dstt_flash_command(m_batch, 0, offset & 0xFFFFFFFC, 0, (uint8_t*)&status);
+            m_batch.send();
 
-            dstt_flash_command(0x87, 0x00, 0x50); // Clear Status Register
-            //dstt_flash_command(0x87, offset, 0xFF); // Reset (offset not required)
+            return Wait_Type2(offset, status, m_program_max_polls, 0);
         } else if (m_cmd_type == DSTT_CMD_TYPE_1) {
-            dstt_flash_command(0x87, 0x5555, 0xAA);
-            dstt_flash_command(0x87, 0x2AAA, 0x55);
-            dstt_flash_command(0x87, 0x5555, 0xA0);
-            dstt_flash_command(0x87, offset, data);
+            if (!m_unlock_bypass) {
+                dstt_flash_command(m_batch, 0x87, 0x5555, 0xAA);
+                dstt_flash_command(m_batch, 0x87, 0x2AAA, 0x55);
+                dstt_flash_command(m_batch, 0x87, 0x5555, 0xA0);
+            } else {
+                dstt_flash_command(m_batch, 0x87, 0x00, 0xA0);
+            }
+            dstt_flash_command(m_batch, 0x87, offset, data);
+            dstt_flash_command(m_batch, 0, offset, 0, (uint8_t*)&status);
+            m_batch.send();
+
+            return Wait_Type1(offset, data, status, m_program_max_polls, 0);
+        }
+
+        return true;
+    }
+
+    void Read_Block(uint32_t address, uint32_t length, uint8_t *buffer, bool progress = false)
+    {
+        dstt_reset();
+
+        uint32_t i = 0;
+        uint32_t end_address = address + length;
+        uint32_t tail;
+
+        while (address < end_address)
+        {
+            // the response is the little-endian word at address, so it can land straight in buffer
+            uint32_t chunk_end = std::min<uint32_t>(end_address, address + 0x200);
+            for (; address < chunk_end; address += 4, i += 4) {
+                dstt_flash_command(m_batch, 0, address, 0, (end_address - address >= 4) ? buffer + i : (uint8_t*)&tail);
+            }
+            m_batch.send();
+            if (progress) {
+                showProgress(address, end_address, "Reading");
+            }
+        }
+
+        if (length % 4)
+            memcpy(buffer + (length & ~3), &tail, length % 4);
+    }
+
+    EraseBlock eraseBlockAt(uint32_t address)
+    {
+        uint32_t sector_addr = 0;
+        for (auto const& sector_sz: m_sectors) {
+            if (address < sector_addr + sector_sz)
+                return {sector_addr, sector_sz};
+            sector_addr += sector_sz;
+        }
+        return {address, 0};
+    }
+
+    // segments are sorted, so only the last one can run past the end
+    bool segments_in_range(const WriteSegment *segments, size_t count)
+    {
+        const WriteSegment *last = count ? &segments[count - 1] : nullptr;
+        if (last && (last->address > m_max_length || last->length > m_max_length - last->address)) {
+            logMessage(LOG_ERR, "DSTT: writeSegments out of range");
+            return false;
+        }
+        return true;
+    }
+
+    bool rmwRead(uint32_t address, uint32_t length, uint8_t *buffer)
+    {
+        Read_Block(address, length, buffer);
+        return true;
+    }
 
-            // TODO: Timeout if something goes wrong.
-            while ((uint8_t)dstt_flash_command(0, offset, 0) != data);
+    bool rmwErase(const EraseBlock &block)
+    {
+        return Erase_Block(block.address);
+    }
+
+    bool rmwProgram(uint32_t address, uint32_t length, const uint8_t *data, const uint8_t *old)
+    {
+        bool ok = true;
+        Program_Begin();
+        for (uint32_t i = 0; ok && i < length; i++) {
+            if (data[i] != (old ? old[i] : 0xFF))
+                ok = Program_Byte(address + i, data[i]);
         }
+        Program_End();
+        return ok;
     }
 
 public:
@@ -334,6 +629,10 @@ public:
     const char *getAuthor() { return "handsomematt"; }
     const char *getDescription() { return "This will run on the official DSTT as well as a\nlot of clones.\n\nCheck the README.md for further details."; }
 
+    // every read is a single word
+    uint32_t getReadChunkSize() { return 4; }
+    uint32_t getWriteFlags() { return WRITE_DIFFERENTIAL | WRITE_SKIPS_BLANK; }
+
     bool initialize()
     {
         logMessage(LOG_INFO, "DSTT: Init");
@@ -341,8 +640,15 @@ public:
 
         m_flashchip = get_flashchip_id();
         logMessage(LOG_NOTICE, "DSTT: Flashchip ID = 0x%04x", m_flashchip);
-        if (!flashchip_supported(m_flashchip))
-            return false;
+
+        // Chips that aren't in our tables can still be used if they describe themselves through CFI.
+        // The ones that are aren't queried: their tables and default timeouts are known to work.
+        const CfiInfo *cfi = nullptr;
+        if (!flashchip_supported(m_flashchip)) {
+            cfi = &get_cfi_info(m_flashchip);
+            if (!cfi->valid)
+                return false;
+        }
 
         switch(m_flashchip) {
             case 0x49B0:
@@ -360,10 +666,21 @@ public:
                 m_cmd_type = DSTT_CMD_TYPE_2;
                 break;
             default:
-                m_cmd_type = DSTT_CMD_TYPE_1;
+                m_cmd_type = (cfi && !cfi->amd) ? DSTT_CMD_TYPE_2 : DSTT_CMD_TYPE_1;
                 break;
         }
 
+        m_sectors = get_sector_map(m_flashchip);
+        m_unlock_bypass = supports_unlock_bypass(m_flashchip);
+        m_program_max_polls = default_program_max_polls;
+        m_erase_max_polls = default_erase_max_polls;
+
+        if (cfi) {
+            m_sectors = cfi->sectors;
+            m_program_max_polls = std::max(m_program_max_polls, cfi->program_max_us);
+            m_erase_max_polls = std::max(m_erase_max_polls, cfi->erase_max_ms * 2);
+        }
+
         return true;
     }
 
@@ -373,65 +690,54 @@ public:
 
     bool readFlash(uint32_t address, uint32_t length, uint8_t *buffer) {
         logMessage(LOG_INFO, "DSTT: readFlash(addr=0x%08x, size=0x%x)", address, length);
-        dstt_reset();
-
-        uint32_t i = 0;
-        uint32_t end_address = address + length;
-
-        while (address < end_address)
-        {
-            uint32_t data = dstt_flash_command(0, address, 0);
-            showProgress(address+1, end_address, "Reading");
-
-            buffer[i++] = (uint8_t)((data >> 0) & 0xFF);
-            buffer[i++] = (uint8_t)((data >> 8) & 0xFF);
-            buffer[i++] = (uint8_t)((data >> 16) & 0xFF);
-            buffer[i++] = (uint8_t)((data >> 24) & 0xFF);
-
-            address += 4;
-        }
-
+        if (readCacheEnabled())
+            return readCached(address, length, buffer, true);
+        Read_Block(address, length, buffer, true);
         return true;
     }
 
-    // todo: we're just assuming this is block (0x2000) aligned
     bool writeFlash(uint32_t address, uint32_t length, const uint8_t *buffer)
     {
-        // really fucking temporary, writeFlash can only do full length writes
-        // todo: read and erase properly
-        Erase_Chip();
         logMessage(LOG_INFO, "DSTT: writeFlash(addr=0x%08x, size=0x%x)", address, length);
-
-        for(uint32_t i = 0; i < length; i++)
-        {
-            showProgress(i+1, length, "Writing");
-            Program_Byte(address++, buffer[i]);
+        if (address > m_max_length || length > m_max_length - address) {
+            logMessage(LOG_ERR, "DSTT: writeFlash out of range");
+            return false;
         }
 
-        return true;
+        // only the sectors overlapping the range are touched
+        return writeBlocks(address, length, buffer);
+    }
+
+    // Sectors that hold more than one segment are only erased and programmed once.
+    bool writeSegments(const WriteSegment *segments, size_t count)
+    {
+        return segments_in_range(segments, count) && writeBlocks(segments, count);
+    }
+
+    bool startWrite(const WriteSegment *segments, size_t count)
+    {
+        return segments_in_range(segments, count) && startBlocks(segments, count);
     }
 
     bool injectNtrBoot(uint8_t *blowfish_key, uint8_t *firm, uint32_t firm_size) {
-        // todo: we just read and write the entire flash chip because we don't align blocks
-        // properly, when writeFlash works, don't use memcpy
+        const uint32_t key1_adr = 0x1000;
+        const uint32_t key2_adr = 0x2000;
+        const uint32_t firm_adr = 0x7E00;
+
         logMessage(LOG_INFO, "DSTT: Injecting Ntrboot");
 
         // don't bother installing if we can't fit
-        if (firm_size > m_max_length - 0x7E00) {
+        if (firm_size > m_max_length - firm_adr) {
             logMessage(LOG_ERR, "DSTT: Firm too large!");
             return false; // todo: return error code
         }
 
-        uint8_t* buffer = (uint8_t*)malloc(m_max_length);
-        readFlash(0, m_max_length, buffer);
-
-        memcpy(buffer + 0x1000, blowfish_key, 0x48);
-        memcpy(buffer + 0x2000, blowfish_key + 0x48, 0x1000);
-        memcpy(buffer + 0x7E00, firm, firm_size);
-
-        writeFlash(0, m_max_length, buffer);
-
-        return true;
+        const WriteSegment segments[] = {
+            {key1_adr, 0x48, blowfish_key},
+            {key2_adr, 0x1000, blowfish_key + 0x48},
+            {firm_adr, firm_size, firm},
+        };
+        return writeSegments(segments, 3);
     }
 };
 
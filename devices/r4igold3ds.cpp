@@ -3,58 +3,47 @@
 #include <cstring>
 #include <algorithm>
 
-#define BIT(n) (1 << (n))
-
 namespace flashcart_core {
 using ntrcard::sendCommand;
+using ntrcard::CommandBatch;
 using platform::logMessage;
 using platform::showProgress;
 
+namespace {
+constexpr uint8_t type1_bits[8] = {4, 3, 7, 6, 1, 0, 2, 5};
+constexpr BytePermutation type1_encrypt(type1_bits);
+
+// every byte has to come back out of the scrambler, or something written won't read back
+constexpr bool type1_is_bijective() {
+    const BytePermutation inv = type1_encrypt.inverse();
+    for (uint32_t v = 0; v < 0x100; ++v) {
+        if (inv(type1_encrypt(static_cast<uint8_t>(v))) != v) {
+            return false;
+        }
+    }
+    return true;
+}
+static_assert(type1_is_bijective(), "type 1 scrambler loses bits");
+}
+
 class R4i_Gold_3DS : Flashcart {
 private:
-    uint8_t encrypt(uint8_t dec, uint32_t offset)
+    // type 1 scrambles the bits of each byte, type 2 XORs it with (offset + 9)
+    void encrypt_memcpy(uint8_t *dst, const uint8_t *src, uint32_t length)
     {
-        uint8_t enc = 0;
         switch (m_r4i_type) {
             case 1:
-                if (dec & BIT(0)) enc |= BIT(4);
-                if (dec & BIT(1)) enc |= BIT(3);
-                if (dec & BIT(2)) enc |= BIT(7);
-                if (dec & BIT(3)) enc |= BIT(6);
-                if (dec & BIT(4)) enc |= BIT(1);
-                if (dec & BIT(5)) enc |= BIT(0);
-                if (dec & BIT(6)) enc |= BIT(2);
-                if (dec & BIT(7)) enc |= BIT(5);
-                return enc;
+                type1_encrypt.apply(dst, src, length);
+                break;
             case 2:
-                enc = (offset % 256) + 9;
-                return enc ^ dec;
+                applyOffsetXor(dst, src, length, 0, 9);
+                break;
         }
-        // FIXME throw error
-        return enc;
     }
 
-    static uint8_t decrypt(uint8_t enc)
-    {
-         uint8_t dec = 0;
-         if (enc & BIT(0)) dec |= BIT(5);
-         if (enc & BIT(1)) dec |= BIT(4);
-         if (enc & BIT(2)) dec |= BIT(6);
-         if (enc & BIT(3)) dec |= BIT(1);
-         if (enc & BIT(4)) dec |= BIT(0);
-         if (enc & BIT(5)) dec |= BIT(7);
-         if (enc & BIT(6)) dec |= BIT(3);
-         if (enc & BIT(6)) dec |= BIT(2);
-         return dec;
-    }
-
-    void encrypt_memcpy(uint8_t *dst, uint8_t *src, uint32_t length)
-    {
-        for(int i = 0; i < (int)length; ++i)
-            dst[i] = encrypt(src[i], i);
-    }
-
-    void r4i_read(uint8_t *outbuf, uint32_t address) {
+    // queued in m_batch along with the busy poll that follows it; *busy_state is
+    // filled in once the batch is sent
+    void r4i_read(uint8_t *outbuf, uint32_t address, uint32_t *busy_state) {
         uint8_t cmdbuf[8];
         logMessage(LOG_DEBUG, "R4iGold: read(0x%08x)", address);
         memcpy(cmdbuf, cmdReadFlash, 8);
@@ -62,27 +51,39 @@ private:
         cmdbuf[2] = (address >>  8) & 0xFF;
         cmdbuf[3] = (address >>  0) & 0xFF;
 
-        sendCommand(cmdbuf, 0x200, outbuf, 32);
-        r4i_wait_flash_busy();
+        m_batch.add(cmdbuf, 0x200, outbuf, 32);
+        m_batch.add(cmdWaitFlashBusy, 4, (uint8_t *)busy_state, 32);
     }
 
-    void r4i_erase(uint32_t address)
+    // sends cmdbuf with the first busy poll right behind it
+    void r4i_send_wait_flash_busy(const uint8_t *cmdbuf)
     {
         uint32_t status;
+        uint32_t state;
+        m_batch.add(cmdbuf, 4, (uint8_t*)&status, 32);
+        m_batch.add(cmdWaitFlashBusy, 4, (uint8_t *)&state, 32);
+        m_batch.send();
+        logMessage(LOG_DEBUG, "R4iGold: waitFlashBusy = 0x%08x", state);
+        if ((state & 1) != 0)
+            r4i_wait_flash_busy();
+    }
+
+    // doesn't wait for the erase to finish (see rmwBusy)
+    void r4i_erase(uint32_t address)
+    {
         uint8_t cmdbuf[8];
+        uint32_t status;
         logMessage(LOG_DEBUG, "R4iGold: erase(0x%08x)", address);
         memcpy(cmdbuf, cmdEraseFlash, 8);
         cmdbuf[1] = (address >> 16) & 0xFF;
         cmdbuf[2] = (address >>  8) & 0xFF;
         cmdbuf[3] = (address >>  0) & 0xFF;
 
-        sendCommand(cmdbuf, 4, (uint8_t*)&status, 32);
-        r4i_wait_flash_busy();
+        sendCommand(cmdbuf, 4, (uint8_t *)&status, 32);
     }
 
     void r4i_writebyte(uint32_t address, uint8_t value)
     {
-        uint32_t status;
         uint8_t cmdbuf[8];
         logMessage(LOG_DEBUG, "R4iGold: write(0x%08x) = 0x%02x", address, value);
         memcpy(cmdbuf, cmdWriteByteFlash, 8);
@@ -91,16 +92,49 @@ private:
         cmdbuf[3] = (address >>  0) & 0xFF;
         cmdbuf[4] = value;
 
-        sendCommand(cmdbuf, 4, (uint8_t*)&status, 32);
-        r4i_wait_flash_busy();
+        r4i_send_wait_flash_busy(cmdbuf);
     }
 
-    void r4i_wait_flash_busy() {
+    bool r4i_flash_busy() {
         uint32_t state;
-        do {
-            sendCommand(cmdWaitFlashBusy, 4, (uint8_t *)&state, 32);
-            logMessage(LOG_DEBUG, "R4iGold: waitFlashBusy = 0x%08x", state);
-        } while ((state & 1) != 0);
+        sendCommand(cmdWaitFlashBusy, 4, (uint8_t *)&state, 32);
+        logMessage(LOG_DEBUG, "R4iGold: waitFlashBusy = 0x%08x", state);
+        return (state & 1) != 0;
+    }
+
+    void r4i_wait_flash_busy() {
+        waitUntil([this] { return !r4i_flash_busy(); });
+    }
+
+    void r4i_read_range(uint32_t address, uint32_t length, uint8_t *buffer, bool progress)
+    {
+        uint32_t busy_state[0x10];
+        uint8_t tail[0x200];
+        for (uint32_t curpos=0; curpos < length; ) {
+            const uint32_t start = curpos;
+            uint32_t n = 0;
+            for (; n < 0x10 && curpos < length; ++n, curpos+=0x200) {
+                r4i_read(length - curpos >= 0x200 ? buffer + curpos : tail, address + curpos, &busy_state[n]);
+            }
+            m_batch.send();
+
+            // Every read was queued as if the flash wouldn't go busy. If a poll says it did, the reads
+            // after that one went out while it was busy: wait, and read again from there.
+            uint32_t i = 0;
+            while (i < n && (busy_state[i] & 1) == 0) {
+                ++i;
+            }
+            if (i < n) {
+                r4i_wait_flash_busy();
+                curpos = std::min(curpos, start + (i + 1) * 0x200);
+            }
+            if (curpos > length) {
+                memcpy(buffer + (length & ~0x1FFu), tail, length & 0x1FF);
+            }
+            if (progress) {
+                showProgress(curpos,length, "Reading");
+            }
+        }
     }
 
     bool injectNtrBootType1(uint8_t *blowfish_key, uint8_t *firm, uint32_t firm_size)
@@ -110,22 +144,24 @@ private:
         const uint32_t firm_adr = 0x80000;
 
         logMessage(LOG_INFO, "R4iGold: Injecting ntrboot");
-        uint8_t *chunk0 = (uint8_t *)malloc(0x10000);
-        readFlash(blowfish_adr, 0x10000, chunk0);
-        encrypt_memcpy(chunk0, blowfish_key, 0x1048);
-        encrypt_memcpy(chunk0 + firm_hdr_adr, firm, 0x200);
-        writeFlash(blowfish_adr, 0x10000, chunk0);
-        free(chunk0);
-
-        uint32_t buf_size = PAGE_ROUND_UP(firm_size - 0x200, 0x10000);
-        uint8_t *firm_chunk = (uint8_t *)malloc(buf_size);
-        readFlash(firm_adr, buf_size, firm_chunk);
-        encrypt_memcpy(firm_chunk, firm + 0x200, firm_size);
-        writeFlash(firm_adr, buf_size, firm_chunk);
-
-        free(firm_chunk);
-
-        return true;
+        // everything is stored encrypted; the key and the FIRM header share a block, which
+        // writeSegments then only erases once
+        uint8_t *buf = (uint8_t *)malloc(0x1048 + firm_size);
+        if (!buf) {
+            logMessage(LOG_ERR, "R4iGold: failed to allocate 0x%x bytes", 0x1048 + firm_size);
+            return false;
+        }
+        encrypt_memcpy(buf, blowfish_key, 0x1048);
+        encrypt_memcpy(buf + 0x1048, firm, firm_size);
+
+        const WriteSegment segments[] = {
+            {blowfish_adr, 0x1048, buf},
+            {firm_hdr_adr, 0x200, buf + 0x1048},
+            {firm_adr, firm_size - 0x200, buf + 0x1048 + 0x200},
+        };
+        bool ret = writeSegments(segments, 3);
+        free(buf);
+        return ret;
     }
 
     bool injectNtrBootType2(uint8_t *blowfish_key, uint8_t *firm, uint32_t firm_size)
@@ -133,43 +169,30 @@ private:
         const uint32_t blowfish_adr = 0x0;
         const uint32_t firm_chunk_adr = 0x80000;
         //overall bootloader addr 0x82200* (*writing directly to this addr was destroying bootloader data)
+        // (writeFlash now preserves the rest of each block, so it's written directly)
         const uint32_t firm_adr = 0x2200;
         const uint32_t firm_hdr_chunk_adr = 0x1F0000;
 
         //this is overall bootloader address 0x1FFE00
         const uint32_t firm_hdr_adr = 0xFE00;
 
-
         logMessage(LOG_INFO, "R4iGold: Injecting ntrboot");
-        uint8_t *chunk0 = (uint8_t *)malloc(0x10000);
-
-        readFlash(blowfish_adr, 0x10000, chunk0);
-        memcpy(chunk0, blowfish_key, 0x1048);
-
-        writeFlash(blowfish_adr, 0x10000, chunk0);
-
-        //readFlash(firm_chunk_adr, 0x10000, chunk0);
-        //encrypt_memcpy(chunk0 + firm_adr, firm + 0x200, firm_size);
-        //writeFlash(firm_chunk_adr, 0x10000, chunk0);
-
-        readFlash(firm_hdr_chunk_adr, 0x10000, chunk0);
-        memcpy(chunk0 + firm_hdr_adr, firm, 0x200);
-        writeFlash(firm_hdr_chunk_adr, 0x10000, chunk0);
-
-        free(chunk0);
-
-        uint32_t buf_size = PAGE_ROUND_UP(firm_size - 0x200 + firm_adr, 0x10000);
-
-        uint8_t *firm_chunk = (uint8_t *)malloc(buf_size);
-        readFlash(firm_chunk_adr, buf_size, firm_chunk);
-
-        encrypt_memcpy(firm_chunk + firm_adr, firm + 0x200, firm_size);
-
-        writeFlash(firm_chunk_adr, buf_size, firm_chunk);
-
-        free(firm_chunk);
-
-        return true;
+        // only the FIRM body is stored encrypted
+        uint8_t *buf = (uint8_t *)malloc(firm_size - 0x200);
+        if (!buf) {
+            logMessage(LOG_ERR, "R4iGold: failed to allocate 0x%x bytes", firm_size - 0x200);
+            return false;
+        }
+        encrypt_memcpy(buf, firm + 0x200, firm_size - 0x200);
+
+        const WriteSegment segments[] = {
+            {blowfish_adr, 0x1048, blowfish_key},
+            {firm_chunk_adr + firm_adr, firm_size - 0x200, buf},
+            {firm_hdr_chunk_adr + firm_hdr_adr, 0x200, firm},
+        };
+        bool ret = writeSegments(segments, 3);
+        free(buf);
+        return ret;
     }
 
 protected:
@@ -182,6 +205,42 @@ protected:
 
     uint8_t m_r4i_type;
 
+    // erase block size
+    static const uint32_t block_size = 0x10000;
+
+    CommandBatch m_batch;
+
+    EraseBlock eraseBlockAt(uint32_t address)
+    {
+        if (address >= getMaxLength()) return {address, 0};
+        return {PAGE_ROUND_DOWN(address, block_size), block_size};
+    }
+
+    bool rmwRead(uint32_t address, uint32_t length, uint8_t *buffer)
+    {
+        r4i_read_range(address, length, buffer, false);
+        return true;
+    }
+
+    bool rmwEraseStart(const EraseBlock &block)
+    {
+        r4i_erase(block.address);
+        return true;
+    }
+
+    bool rmwBusy()
+    {
+        return r4i_flash_busy();
+    }
+
+    bool rmwProgram(uint32_t address, uint32_t length, const uint8_t *data, const uint8_t *old)
+    {
+        for (uint32_t i=0; i < length; i++) {
+            if (data[i] != (old ? old[i] : 0xFF)) r4i_writebyte(address + i, data[i]);
+        }
+        return true;
+    }
+
 public:
     R4i_Gold_3DS() : Flashcart("R4i Gold 3DS", 0x400000) { }
 
@@ -208,6 +267,8 @@ public:
         return 0x0;
     }
 
+    uint32_t getWriteFlags() { return WRITE_DIFFERENTIAL | WRITE_SKIPS_BLANK; }
+
     bool initialize()
     {
         logMessage(LOG_INFO, "R4iGold: Init");
@@ -239,30 +300,34 @@ public:
     bool readFlash(uint32_t address, uint32_t length, uint8_t *buffer)
     {
         logMessage(LOG_INFO, "R4iGold: readFlash(addr=0x%08x, size=0x%x)", address, length);
-        for (uint32_t curpos=0; curpos < length; curpos+=0x200) {
-            r4i_read(buffer + curpos, address + curpos);
-            showProgress(curpos+1,length, "Reading");
-        }
-
+        if (readCacheEnabled()) return readCached(address, length, buffer, true);
+        r4i_read_range(address, length, buffer, true);
         return true;
     }
 
     bool writeFlash(uint32_t address, uint32_t length, const uint8_t *buffer)
     {
         logMessage(LOG_INFO, "R4iGold: writeFlash(addr=0x%08x, size=0x%x)", address, length);
-        for (uint32_t addr=0; addr < length; addr+=0x10000)
-            r4i_erase(address + addr);
+        return writeBlocks(address, length, buffer);
+    }
 
-        for (uint32_t i=0; i < length; i++) {
-            r4i_writebyte(address + i, buffer[i]);
-            showProgress(i+1,length, "Writing");
-        }
+    bool writeSegments(const WriteSegment *segments, size_t count)
+    {
+        return writeBlocks(segments, count);
+    }
 
-        return true;
+    bool startWrite(const WriteSegment *segments, size_t count)
+    {
+        return startBlocks(segments, count);
     }
 
     bool injectNtrBoot(uint8_t *blowfish_key, uint8_t *firm, uint32_t firm_size)
     {
+        if (firm_size < 0x200) {
+            logMessage(LOG_ERR, "R4iGold: FIRM is smaller than its header");
+            return false;
+        }
+
         switch (m_r4i_type) {
             case 1:
                 return injectNtrBootType1(blowfish_key, firm, firm_size);
@@ -1,3 +1,4 @@
+#include <cstdlib>
 #include <cstring>
 #include <algorithm>
 
@@ -6,8 +7,8 @@
 namespace flashcart_core {
 using ntrcard::sendCommand;
 using ntrcard::BlowfishKey;
+using ntrcard::CommandBatch;
 using platform::logMessage;
-using platform::ioDelay;
 using platform::showProgress;
 
 namespace {
@@ -34,6 +35,30 @@ constexpr uint64_t norRaw(const uint8_t d1, const uint8_t d2, const uint8_t fpga
 }
 static_assert(norRaw(0x34, 0x56, 0x12) == 0x56341299, "norRaw result is wrong");
 
+constexpr uint64_t romRead(const uint32_t addr) {
+    // 00 00 00 AA AA AA AA B7
+    return 0xB7ull | (static_cast<uint64_t>(addr & 0xFF000000) >> 16) | (static_cast<uint64_t>(addr & 0xFF0000)) |
+        (static_cast<uint64_t>(addr & 0xFF00) << 16) | (static_cast<uint64_t>(addr & 0xFF) << 32);
+}
+static_assert(romRead(0x12345678) == 0x78563412B7ull, "romRead result is wrong");
+
+CommandBatch nor_batch;
+
+struct NorErase {
+    uint32_t size;
+    uint8_t op;
+};
+
+// What we know about the NOR, see norDiscover. Defaults to the 2 MiB part with 4K sector erase these carts have.
+struct NorInfo {
+    uint32_t size = 0x200000;
+    uint32_t page_size = 0x100;
+    // smallest first, all between 4K and 64K
+    std::vector<NorErase> erases = {{0x1000, 0x20}};
+};
+
+NorInfo nor_info;
+
 uint32_t norRead(const uint32_t address) {
     CmdBuf4 buf;
     sendCommand(norCmd(2, 5, 0x3B, address), 4, buf.u8, 0x180000);
@@ -41,86 +66,428 @@ uint32_t norRead(const uint32_t address) {
     return buf.u32;
 }
 
-void norWriteEnable() {
-    sendCommand(norCmd(0, 1, 6, 0), 4, nullptr, 0x180000);
-    ioDelay(0x60000);
+uint8_t norReadStatus() {
+    CmdBuf4 buf;
+    sendCommand(norCmd(1, 1, 5, 0), 4, buf.u8, 0x180000);
+    return buf.u8[0];
 }
 
-void norErase4k(const uint32_t address) {
-    norWriteEnable();
-    sendCommand(norCmd(0, 4, 0x20, address), 4, nullptr, 0x180000);
-    ioDelay(41000000);
+// Sends WREN and checks that the status register shows WEL. If it does, status reads work and the
+// next erase/program can poll WIP; if not (all-FF, or the FPGA doesn't pass RDSR through), callers
+// fall back to waiting the worst case.
+bool norWriteEnable() {
+    CmdBuf4 status;
+    nor_batch.add(norCmd(0, 1, 6, 0), 4, nullptr, 0x180000);
+    nor_batch.add(norCmd(1, 1, 5, 0), 4, status.u8, 0x180000);
+    nor_batch.send();
+
+    if ((status.u8[0] & 3) == 2 && status.u8[0] != 0xFF) {
+        return true;
+    }
+    logMessage(LOG_DEBUG, "R4ISDHC: RDSR after WREN returned %02X, using fixed delays", status.u8[0]);
+    waitDelay(0x60000);
+    return false;
 }
 
-void norWrite256(const uint32_t address, const uint8_t *bytes) {
-    norWriteEnable();
-    sendCommand(norCmd(0, 6, 2, address, bytes[0], bytes[1]), 4, nullptr, 0x180000);
-    for (uint32_t cur = 2; cur < 0x100; cur += 2) {
-        sendCommand(norRaw(bytes[cur], bytes[cur+1]), 4, nullptr, 0x180000);
+// Polls WIP until the NOR is done with an erase/program; false if it's still busy after max_polls.
+bool norWaitReady(const uint32_t max_polls, const uint32_t interval_us) {
+    if (waitUntil([] { return !(norReadStatus() & 1); }, max_polls, interval_us)) {
+        return true;
     }
-    sendCommand(norRaw(bytes[0], bytes[1], 0xF0), 4, nullptr, 0x180000);
-    ioDelay(0x60000);
+    logMessage(LOG_ERR, "R4ISDHC: NOR still busy after %u status polls", max_polls);
+    return false;
 }
 
-void norWrite4k(const uint32_t address, const uint8_t *bytes) {
-    uint32_t cur = 0;
-    while (cur < 0x1000) {
-        norWrite256(address + cur, bytes + cur);
-        cur += 0x100;
+bool norErase(const uint32_t address, const NorErase &erase) {
+    const bool has_status = norWriteEnable();
+    sendCommand(norCmd(0, 4, erase.op, address), 4, nullptr, 0x180000);
+    if (has_status) {
+        // a sector erase is typically tens of ms (a 64K block a few hundred); give it as long as the fixed delay
+        return norWaitReady(41000, 1000);
+    }
+    waitDelay(41000000);
+    return true;
+}
+
+// `size` is at most 0x100, and even
+bool norWritePage(const uint32_t address, const uint8_t *bytes, const uint32_t size) {
+    const bool has_status = norWriteEnable();
+    nor_batch.add(norCmd(0, 6, 2, address, bytes[0], bytes[1]), 4, nullptr, 0x180000);
+    for (uint32_t cur = 2; cur < size; cur += 2) {
+        nor_batch.add(norRaw(bytes[cur], bytes[cur+1]), 4, nullptr, 0x180000);
+    }
+    nor_batch.add(norRaw(bytes[0], bytes[1], 0xF0), 4, nullptr, 0x180000);
+    nor_batch.send();
+    if (has_status) {
+        return norWaitReady(500, 100);
+    }
+    waitDelay(0x60000);
+    return true;
+}
+
+bool isBlank(const uint8_t *bytes, const uint32_t size) {
+    return std::all_of(bytes, bytes + size, [](uint8_t b) { return b == 0xFF; });
+}
+
+// Programs an erased block; pages that are all FF are left as they are.
+bool norWriteBlock(const uint32_t address, const uint8_t *bytes, const uint32_t size) {
+    for (uint32_t cur = 0; cur < size; cur += nor_info.page_size) {
+        if (!isBlank(bytes + cur, nor_info.page_size) && !norWritePage(address + cur, bytes + cur, nor_info.page_size)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void sfdpRead(const uint32_t address, const uint32_t length, uint8_t *const buffer) {
+    for (uint32_t cur = 0; cur < length; cur += 4) {
+        nor_batch.add(norCmd(1, 5, 0x5A, address + cur), 4, buffer + cur, 0x180000);
+    }
+    nor_batch.send();
+}
+
+// Reads the JEDEC ID for the capacity and the SFDP basic parameter table (if any) for the erase types and page
+// size. Anything that doesn't make sense leaves the defaults alone.
+void norDiscover() {
+    CmdBuf4 id;
+    uint8_t sfdp[0x10];
+    uint32_t bfpt[16] = {0};
+
+    nor_info = NorInfo();
+
+    sendCommand(norCmd(1, 1, 0x9F, 0), 4, id.u8, 0x180000);
+    logMessage(LOG_INFO, "R4ISDHC: NOR JEDEC ID %02X %02X %02X", id.u8[0], id.u8[1], id.u8[2]);
+    if (id.u8[0] != 0x00 && id.u8[0] != 0xFF && id.u8[2] >= 0x11 && id.u8[2] <= 0x19) {
+        nor_info.size = 1u << id.u8[2];
     }
+
+    // SFDP header, then the first parameter header, which is the basic flash parameter table
+    sfdpRead(0, sizeof(sfdp), sfdp);
+    if (std::memcmp(sfdp, "SFDP", 4) || sfdp[8] != 0x00 || sfdp[11] < 9) {
+        logMessage(LOG_INFO, "R4ISDHC: no SFDP, assuming 4K erase and 256 byte pages");
+        return;
+    }
+    const uint32_t bfpt_dwords = std::min<uint32_t>(sfdp[11], 16);
+    sfdpRead(sfdp[12] | (sfdp[13] << 8) | (sfdp[14] << 16), bfpt_dwords * 4, reinterpret_cast<uint8_t *>(bfpt));
+
+    // density is in bits: N+1, or 2^N if bit 31 is set
+    const uint32_t density = bfpt[1];
+    const uint64_t size = (density & 0x80000000) ? (1ull << std::min<uint32_t>(density & 0x7FFFFFFF, 40)) / 8 : (density + 1ull) / 8;
+    if (size >= 0x20000 && size <= 0x4000000) {
+        nor_info.size = static_cast<uint32_t>(size);
+    }
+
+    // erase types 1-4: 2^N bytes, instruction
+    std::vector<NorErase> erases;
+    for (uint32_t i = 0; i < 4; ++i) {
+        const uint16_t type = bfpt[7 + i / 2] >> (16 * (i % 2));
+        const uint8_t n = type & 0xFF;
+        if (n >= 12 && n <= 16) {
+            erases.push_back({1u << n, static_cast<uint8_t>(type >> 8)});
+        }
+    }
+    if (!erases.empty()) {
+        std::sort(erases.begin(), erases.end(), [](const NorErase &a, const NorErase &b) { return a.size < b.size; });
+        nor_info.erases = erases;
+    }
+
+    // page size: 2^N bytes (JESD216A and later)
+    if (bfpt_dwords >= 11) {
+        const uint32_t page_size = 1u << ((bfpt[10] >> 4) & 0xF);
+        if (page_size >= 0x10) {
+            // larger pages are still programmed 0x100 at a time, the most we know the FPGA passes through
+            nor_info.page_size = std::min<uint32_t>(page_size, 0x100);
+        }
+    }
+
+    logMessage(LOG_INFO, "R4ISDHC: NOR is 0x%x bytes, %u erase sizes (0x%x-0x%x), 0x%x byte pages", nor_info.size,
+        static_cast<uint32_t>(nor_info.erases.size()), nor_info.erases.front().size, nor_info.erases.back().size,
+        nor_info.page_size);
 }
 
+// Largest NOR read that comes back intact from a single passthrough command, see norProbeReadBurst.
+// 4 (only word reads) until probed.
+uint32_t nor_read_burst = 4;
+
+// Whether plain ROM reads (0xB7) return the NOR 1:1, which is what the map injectNtrBoot writes at 0x40 sets up
+// on type 1 carts. ROM reads below 0x8000 are redirected like on any other cart, so those always use the passthrough.
+// UNSUPPORTED for type 2 carts, which don't have a map.
+enum class RomMap { UNSUPPORTED, UNKNOWN, NONE, IDENTITY };
+RomMap nor_rom_map = RomMap::UNSUPPORTED;
+
+bool norRomMapped();
+
 bool readNor(const uint32_t address, const uint32_t length, uint8_t *const buffer, bool progress = false) {
+    const uint32_t burst = nor_read_burst;
+    const bool rom_mapped = norRomMapped();
     uint32_t cur = 0;
+    CmdBuf4 tail;
 
     while (cur < length) {
-        uint32_t rd = norRead(address + cur);
-        std::memcpy(buffer + cur, &rd, std::min<uint32_t>(length - cur, sizeof(rd)));
-        cur += 4;
-        if (progress && cur % 0x4000) {
+        // queue 0x200 bytes (or one burst) worth of reads at a time; they land straight in the buffer
+        const uint32_t chunk_end = std::min<uint32_t>(length, cur + std::max<uint32_t>(burst, 0x200));
+        while (cur < chunk_end) {
+            const uint32_t addr = address + cur;
+            if (rom_mapped && addr >= 0x8000 && addr % 0x200 == 0 && chunk_end - cur >= 0x200) {
+                nor_batch.add(romRead(addr), 0x200, buffer + cur, 0x180000);
+                cur += 0x200;
+            } else if (burst > 4 && chunk_end - cur >= burst) {
+                nor_batch.add(norCmd(2, 5, 0x3B, address + cur), burst, buffer + cur, 0x180000);
+                cur += burst;
+            } else {
+                nor_batch.add(norCmd(2, 5, 0x3B, address + cur), 4, (length - cur >= 4) ? buffer + cur : tail.u8, 0x180000);
+                cur += 4;
+            }
+        }
+        nor_batch.send();
+        if (progress && cur % 0x4000 == 0) {
             showProgress(cur, length, "Reading NOR");
         }
     }
 
+    if (length % 4) {
+        std::memcpy(buffer + (length & ~3), tail.u8, length % 4);
+    }
+
     return true;
 }
 
-bool writeNor(const uint32_t dest_address, const uint32_t length, const uint8_t *const src, bool progress = false,
+// Whether the FPGA streams more than a word per read command depends on the cart, so try the sizes
+// a NTR transfer can have against word reads of the same data. That data has to vary, or a burst that
+// just repeats a word (or returns all-FF) would pass too. Called from initialize(), after norDiscover.
+void norProbeReadBurst() {
+    static const uint32_t probe_addresses[] = {0x0, 0x1000, 0x7E00, 0x10000};
+    static const uint32_t bursts[] = {0x1000, 0x800, 0x400, 0x200};
+    uint8_t ref[0x1000], buf[0x1000];
+
+    nor_read_burst = 4;
+    for (uint32_t address : probe_addresses) {
+        readNor(address, sizeof(ref), ref);
+
+        bool varies = false;
+        for (uint32_t i = 4; i < sizeof(ref) && !varies; i += 4) {
+            varies = std::memcmp(ref, ref + i, 4) != 0;
+        }
+        if (!varies) {
+            continue;
+        }
+
+        for (uint32_t burst : bursts) {
+            sendCommand(norCmd(2, 5, 0x3B, address), burst, buf, 0x180000);
+            if (!std::memcmp(ref, buf, burst)) {
+                nor_read_burst = burst;
+                break;
+            }
+        }
+        break;
+    }
+
+    logMessage(LOG_INFO, "R4ISDHC: NOR reads 0x%x bytes per command", nor_read_burst);
+}
+
+bool norRomMapped() {
+    static const uint32_t probe_addresses[] = {0x8000, 0x10000, 0x20000, 0x40000};
+    uint8_t ref[0x200], buf[0x200];
+
+    if (nor_rom_map != RomMap::UNKNOWN) {
+        return nor_rom_map == RomMap::IDENTITY;
+    }
+
+    // read the map as big-endian words: ROM 0 => NOR 0, then the end marker
+    nor_rom_map = RomMap::NONE;
+    if (norRead(0x40) != 0 || norRead(0x44) != 0xFFFFFF7F) {
+        logMessage(LOG_INFO, "R4ISDHC: no 1:1 ROM <=> NOR map, reading through the passthrough");
+        return false;
+    }
+
+    // the map is only picked up at power on, so check that ROM reads really do return NOR data
+    for (uint32_t address : probe_addresses) {
+        readNor(address, sizeof(ref), ref);
+        bool varies = false;
+        for (uint32_t i = 4; i < sizeof(ref) && !varies; i += 4) {
+            varies = std::memcmp(ref, ref + i, 4) != 0;
+        }
+        if (!varies) {
+            continue;
+        }
+
+        sendCommand(romRead(address), sizeof(buf), buf, 0x180000);
+        if (!std::memcmp(ref, buf, sizeof(buf))) {
+            nor_rom_map = RomMap::IDENTITY;
+        }
+        break;
+    }
+
+    logMessage(LOG_INFO, "R4ISDHC: ROM reads %s", nor_rom_map == RomMap::IDENTITY ? "map the NOR 1:1" : "don't match the NOR");
+    return nor_rom_map == RomMap::IDENTITY;
+}
+
+// Writes `segments` (sorted, not overlapping) as one: a window that holds more than one of them is
+// only read, erased and programmed once.
+bool writeNor(const Flashcart::WriteSegment *const segments, const size_t count, bool progress = false,
                 const char *const progress_str = "Writing NOR") {
-    const uint32_t real_start = dest_address & ~0xFFF;
-    const uint32_t first_page_offset = dest_address & 0xFFF;
-    const uint32_t real_length = ((length + first_page_offset) + 0xFFF) & ~0xFFF;
-    uint32_t cur = 0;
-    uint8_t buf[0x1000];
+    // Works one largest-erase-block sized window at a time, comparing in units of the smallest erase:
+    // each run of dirty units is then erased with the largest erase that's aligned and covers only dirty units.
+    const uint32_t unit = nor_info.erases.front().size;
+    const uint32_t window = nor_info.erases.back().size;
+    // what each unit needs: nothing, only bits cleared (programming over it is enough), or an erase
+    enum class Change : uint8_t { NONE, PROGRAM, ERASE } change[0x10000 / 0x1000];
+    uint8_t page[0x100];
+
+    if (!count) {
+        return true;
+    }
+    for (size_t i = 1; i < count; ++i) {
+        if (segments[i].address < segments[i - 1].address + segments[i - 1].length) {
+            logMessage(LOG_ERR, "writeNor: segments overlap or aren't sorted");
+            return false;
+        }
+    }
+
+    const uint32_t real_start = PAGE_ROUND_DOWN(segments[0].address, window);
+    const uint32_t real_length =
+        PAGE_ROUND_UP(segments[count - 1].address + segments[count - 1].length, window) - real_start;
 
     if (progress) {
-            showProgress(cur, real_length, progress_str);
+            showProgress(0, real_length, progress_str);
     }
 
-    while (cur < real_length) {
+    uint8_t *buf = static_cast<uint8_t *>(std::malloc(window));
+    if (!buf) {
+        logMessage(LOG_ERR, "writeNor: failed to allocate 0x%x bytes", window);
+        return false;
+    }
+
+    size_t first = 0;
+    for (uint32_t cur = 0; cur < real_length; cur += window) {
         const uint32_t cur_addr = real_start + cur;
-        const uint32_t buf_ofs = ((dest_address > cur_addr) ? (dest_address - cur_addr) : 0);
-        const uint32_t src_ofs = ((cur > first_page_offset) ? (cur - first_page_offset) : 0);
-        const uint32_t len = std::min<uint32_t>(0x1000 - buf_ofs, std::min<uint32_t>(length - src_ofs, 0x1000));
 
-        if (!readNor(cur_addr, 0x1000, buf)) {
-            logMessage(LOG_ERR, "writeNor: failed to read");
-            return false;
+        // the segments in this window are [first, last)
+        while (first < count && segments[first].address + segments[first].length <= cur_addr) {
+            ++first;
+        }
+        size_t last = first;
+        while (last < count && segments[last].address < cur_addr + window) {
+            ++last;
+        }
+        // the part of segment `i` in [lo, hi) of this window, as [a, b), and the data that goes there
+        auto part = [&](size_t i, uint32_t lo, uint32_t hi, uint32_t &a, uint32_t &b, const uint8_t *&data) {
+            const uint32_t seg_end = segments[i].address + segments[i].length;
+            const uint32_t pa = std::max(segments[i].address, cur_addr + lo);
+            const uint32_t pb = std::min(seg_end, cur_addr + hi);
+            if (pa >= pb) {
+                return false;
+            }
+            a = pa - cur_addr;
+            b = pb - cur_addr;
+            data = segments[i].data + (pa - segments[i].address);
+            return true;
+        };
+
+        // only the units the segments touch are read (in runs) and looked at
+        bool touched[0x10000 / 0x1000] = {false};
+        uint32_t first_unit = window / unit, last_unit = 0;
+        for (size_t i = first; i < last; ++i) {
+            uint32_t a, b;
+            const uint8_t *data;
+            if (part(i, 0, window, a, b, data)) {
+                std::fill(touched + a / unit, touched + (b + unit - 1) / unit, true);
+                first_unit = std::min(first_unit, a / unit);
+                last_unit = std::max(last_unit, (b + unit - 1) / unit);
+            }
+        }
+        for (uint32_t u = first_unit; u < last_unit;) {
+            uint32_t n = 0;
+            while (u + n < last_unit && touched[u + n]) {
+                ++n;
+            }
+            if (n && !readNor(cur_addr + u * unit, n * unit, buf + u * unit)) {
+                logMessage(LOG_ERR, "writeNor: failed to read");
+                std::free(buf);
+                return false;
+            }
+            u += n ? n : 1;
         }
 
-        // don't write if they're already identical
-        if (std::memcmp(buf + buf_ofs, src + src_ofs, len)) {
-            norErase4k(cur_addr);
-            // now ideally if i could read the NOR status register, i'd do the memcpy here
-            // while the NOR does the sector erase, then just wait on it at the end. BUT NOPE!
-            // (and the datasheet doesn't say this chip can read while writing, so that's not an option)
+        // don't write units that are already identical, and don't erase ones that only need bits cleared
+        for (uint32_t u = first_unit; u < last_unit; ++u) {
+            change[u] = Change::NONE;
+            for (size_t i = first; i < last && change[u] != Change::ERASE; ++i) {
+                uint32_t a, b;
+                const uint8_t *data;
+                if (!part(i, u * unit, (u + 1) * unit, a, b, data)) {
+                    continue;
+                }
+                for (uint32_t j = a; j < b && change[u] != Change::ERASE; ++j) {
+                    if (data[j - a] & ~buf[j]) {
+                        change[u] = Change::ERASE;
+                    } else if (data[j - a] != buf[j]) {
+                        change[u] = Change::PROGRAM;
+                    }
+                }
+            }
+
+            if (change[u] != Change::PROGRAM) {
+                continue;
+            }
+            // program just the pages that change, over what's there
+            for (uint32_t p = u * unit; p < (u + 1) * unit; p += nor_info.page_size) {
+                bool dirty = false;
+                std::memset(page, 0xFF, nor_info.page_size);
+                for (size_t i = first; i < last; ++i) {
+                    uint32_t a, b;
+                    const uint8_t *data;
+                    if (part(i, p, p + nor_info.page_size, a, b, data) && std::memcmp(buf + a, data, b - a)) {
+                        std::memcpy(page + (a - p), data, b - a);
+                        dirty = true;
+                    }
+                }
+                if (dirty && !norWritePage(cur_addr + p, page, nor_info.page_size)) {
+                    if (progress) {
+                        showProgress(0, 1, "NOR program timed out");
+                    }
+                    std::free(buf);
+                    return false;
+                }
+            }
+        }
+        for (size_t i = first; i < last; ++i) {
+            uint32_t a, b;
+            const uint8_t *data;
+            if (part(i, 0, window, a, b, data)) {
+                std::memcpy(buf + a, data, b - a);
+            }
+        }
+
+        for (uint32_t u = first_unit; u < last_unit;) {
+            if (change[u] != Change::ERASE) {
+                ++u;
+                continue;
+            }
+            const NorErase *erase = &nor_info.erases.front();
+            for (const NorErase &e : nor_info.erases) {
+                const uint32_t n = e.size / unit;
+                if ((u * unit) % e.size == 0 && u + n <= last_unit &&
+                        std::all_of(change + u, change + u + n, [](Change c) { return c == Change::ERASE; })) {
+                    erase = &e;
+                }
+            }
+            const uint32_t block_addr = cur_addr + u * unit;
+
+            if (!norErase(block_addr, *erase)) {
+                if (progress) {
+                    showProgress(0, 1, "NOR erase timed out");
+                }
+                std::free(buf);
+                return false;
+            }
 
             bool success = false;
             uint32_t retry = 0;
             while (retry < 10) {
                 // some sanity checks..
-                success = norRead(cur_addr) == 0xFFFFFFFF &&
-                    norRead(cur_addr + 0x1000 - 4) == 0xFFFFFFFF;
+                success = norRead(block_addr) == 0xFFFFFFFF &&
+                    norRead(block_addr + erase->size - 4) == 0xFFFFFFFF;
                 if (success) {
                     break;
                 }
@@ -128,45 +495,65 @@ bool writeNor(const uint32_t dest_address, const uint32_t length, const uint8_t
                 showProgress(cur, real_length, "Waiting for NOR erase to finish");
                 ++retry;
                 logMessage(LOG_WARN, "writeNor: start or end isn't FF");
-                ioDelay(41000000);
+                waitDelay(41000000);
             }
 
             if (!success) {
                 if (progress) {
                     showProgress(0, 1, "NOR erase sanity check failed");
                 }
+                std::free(buf);
                 return false;
             }
 
-            std::memcpy(buf + buf_ofs, src + src_ofs, len);
+            if (!norWriteBlock(block_addr, buf + u * unit, erase->size)) {
+                if (progress) {
+                    showProgress(0, 1, "NOR program timed out");
+                }
+                std::free(buf);
+                return false;
+            }
 
-            norWrite4k(cur_addr, buf);
+            u += erase->size / unit;
         }
 
-        cur += 0x1000;
         if (progress) {
-            showProgress(cur, real_length, progress_str);
+            showProgress(cur + window, real_length, progress_str);
         }
     }
+    std::free(buf);
 
-    uint32_t t = norRead(dest_address);
-    if (std::memcmp(&t, src, std::min<uint32_t>(length, 4))) {
-        if (progress) {
-            showProgress(0, 1, "NOR write start verification failed");
+    for (size_t i = 0; i < count; ++i) {
+        const uint32_t dest_address = segments[i].address, length = segments[i].length;
+        const uint8_t *const src = segments[i].data;
+        if (!length) {
+            continue;
         }
-        logMessage(LOG_ERR, "writeNor: start mismatch after write");
-        return false;
-    }
 
-    if (length > 4) {
-        t = norRead(dest_address + length - 4);
-        if (std::memcmp(&t, src + length - 4, 4)) {
+        // the map may have changed, so probe it again on the next read
+        if (nor_rom_map != RomMap::UNSUPPORTED && dest_address < 0x140 && dest_address + length > 0x40) {
+            nor_rom_map = RomMap::UNKNOWN;
+        }
+
+        uint32_t t = norRead(dest_address);
+        if (std::memcmp(&t, src, std::min<uint32_t>(length, 4))) {
             if (progress) {
-                showProgress(0, 1, "NOR write end verification failed");
+                showProgress(0, 1, "NOR write start verification failed");
             }
-            logMessage(LOG_ERR, "writeNor: end mismatch after write");
+            logMessage(LOG_ERR, "writeNor: start mismatch after write");
             return false;
         }
+
+        if (length > 4) {
+            t = norRead(dest_address + length - 4);
+            if (std::memcmp(&t, src + length - 4, 4)) {
+                if (progress) {
+                    showProgress(0, 1, "NOR write end verification failed");
+                }
+                logMessage(LOG_ERR, "writeNor: end mismatch after write");
+                return false;
+            }
+        }
     }
     return true;
 }
@@ -285,9 +672,14 @@ public:
     }
 
     bool initialize() {
+        nor_read_burst = 4;
+        nor_rom_map = RomMap::UNSUPPORTED;
         if (checkCartType1()) {
             cart_type = 1;
             logMessage(LOG_DEBUG, "r4isdhc: found type 1 cart");
+            nor_rom_map = RomMap::UNKNOWN;
+            norDiscover();
+            norProbeReadBurst();
             return true;
         }
         switch (ntrcard::state.status) {
@@ -297,6 +689,8 @@ public:
                     || trySecureInit(BlowfishKey::B9DEV)) {
                     cart_type = 2;
                     logMessage(LOG_DEBUG, "r4isdhc: found type 2 cart");
+                    norDiscover();
+                    norProbeReadBurst();
                     return true;
                 };
                 break;
@@ -304,6 +698,8 @@ public:
                 if (checkCartType2()) {
                     cart_type = 2;
                     logMessage(LOG_DEBUG, "r4isdhc: found type 2 cart");
+                    norDiscover();
+                    norProbeReadBurst();
                     return true;
                 }
                 break;
@@ -317,12 +713,29 @@ public:
 
     void shutdown() { }
 
+    size_t getMaxLength() override { return nor_info.size; }
+
+    // writeNor erases in runs of the smallest erase size, so that's the block that matters to callers
+    EraseBlock eraseBlockAt(uint32_t address) override {
+        const uint32_t unit = nor_info.erases.front().size;
+        if (address >= nor_info.size) return {address, 0};
+        return {PAGE_ROUND_DOWN(address, unit), unit};
+    }
+    uint32_t getProgramSize() override { return nor_info.page_size; }
+    uint32_t getReadChunkSize() override { return std::max<uint32_t>(nor_read_burst, 0x200); }
+    uint32_t getWriteFlags() override { return WRITE_DIFFERENTIAL | WRITE_SKIPS_BLANK; }
+
     bool readFlash(const uint32_t address, const uint32_t length, uint8_t *const buffer) override {
         return readNor(address, length, buffer, true);
     }
 
     bool writeFlash(const uint32_t address, const uint32_t length, const uint8_t *const buffer) override {
-        return writeNor(address, length, buffer, true);
+        const WriteSegment segment = {address, length, buffer};
+        return writeSegments(&segment, 1);
+    }
+
+    bool writeSegments(const WriteSegment *segments, size_t count) override {
+        return writeNorVerified(segments, count, "Writing NOR");
     }
 
     bool injectNtrBoot(uint8_t *blowfish_key, uint8_t *firm, uint32_t firm_size) override {
@@ -335,24 +748,47 @@ public:
             return false;
         }
 
-        uint8_t map[0x100] = {0};
-        // set the 2nd ROM map to some high value (0x7FFFFFFF in big-endian)
-        map[4] = 0x7F; map[5] = 0xFF; map[6] = 0xFF; map[7] = 0xFF;
-        return
+        static const uint8_t map[0x100] = {
+            // set the 2nd ROM map to some high value (0x7FFFFFFF in big-endian)
+            0, 0, 0, 0, 0x7F, 0xFF, 0xFF, 0xFF,
+        };
+        // type2 carts read 0x8000-0x10000 from 0x1F8000-0x200000 instead of from 0x8000
+        const uint32_t firm_hdr_size = std::min<uint32_t>(firm_size, (cart_type == 1 ? 0x200 : 0x8200));
+        const WriteSegment segments[] = {
             // 1:1 map the ROM <=> NOR (unless it's an "old" cart - those don't seem to have
-            // a mapping in the NOR)
-            writeNor(0x1000, 0x48, blowfish_key, true, "Writing Blowfish key (1)") && // blowfish P array
-            writeNor(0x2000, 0x1000, blowfish_key+0x48, true, "Writing Blowfish key (2)") && // blowfish S boxes
-            (
-                (cart_type == 1 && writeNor(0x40, 0x100, map, true, "Writing ROM <=> NOR map")) ||
-                (cart_type == 2 && true) // type 2 not need ROM-NOR map
-            ) &&
-            writeNor(0x1F1000, 0x48, blowfish_key, true, "Writing Blowfish key (3)") && // blowfish P array
-            writeNor(0x1F2000, 0x1000, blowfish_key+0x48, true, "Writing Blowfish key (4)") && // blowfish S boxes
-            writeNor(0x7E00, firm_size, firm, true, "Writing FIRM (1)") && // FIRM
-            // type2 carts read 0x8000-0x10000 from 0x1F8000-0x200000 instead of from 0x8000
-            writeNor(0x1F7E00, std::min<uint32_t>(firm_size, (cart_type == 1 ? 0x200 : 0x8200)), firm, true,
-                "Writing FIRM (2)"); // FIRM header
+            // a mapping in the NOR; type 2 doesn't need one)
+            {0x40, cart_type == 1 ? 0x100u : 0u, map},
+            {0x1000, 0x48, blowfish_key}, // blowfish P array
+            {0x2000, 0x1000, blowfish_key + 0x48}, // blowfish S boxes
+            {0x7E00, firm_size, firm}, // FIRM
+            {0x1F1000, 0x48, blowfish_key}, // blowfish P array
+            {0x1F2000, 0x1000, blowfish_key + 0x48}, // blowfish S boxes
+            {0x1F7E00, firm_hdr_size, firm}, // FIRM header
+        };
+        // the key, map and start of the FIRM share the first 64K, and the copies at the end the last
+        // one, so going through them together erases each of those once rather than up to four times
+        return writeNorVerified(segments, sizeof(segments) / sizeof(segments[0]), "Writing ntrboot");
+    }
+
+protected:
+    // only used by verifyWrite
+    bool rmwRead(uint32_t address, uint32_t length, uint8_t *buffer) override {
+        return readNor(address, length, buffer);
+    }
+
+    // writeNor already checks the first and last word of each segment; with setWriteVerify, all of it
+    bool writeNorVerified(const WriteSegment *segments, size_t count, const char *progress_str) {
+        resetVerifyFailure();
+        if (!writeNor(segments, count, true, progress_str)) {
+            return false;
+        }
+        for (size_t i = 0; verifyEnabled() && i < count; ++i) {
+            if (!verifyWrite(segments[i].address, segments[i].length, segments[i].data)) {
+                showProgress(0, 1, "NOR write verification failed");
+                return false;
+            }
+        }
+        return true;
     }
 };
 
@@ -3,47 +3,68 @@
 #include <cstring>
 #include <algorithm>
 
-#define BIT(n) (1 << (n))
-
 namespace flashcart_core {
 using ntrcard::sendCommand;
+using ntrcard::CommandBatch;
 using platform::logMessage;
 using platform::showProgress;
 
+namespace {
+// scrambled bytes are XORed with 0x98 once the bits are in place
+constexpr uint8_t r4sdhc_bits[8] = {5, 4, 1, 3, 6, 7, 0, 2};
+constexpr BytePermutation r4sdhc_encrypt(r4sdhc_bits, 0, 0x98);
+constexpr BytePermutation r4sdhc_decrypt = r4sdhc_encrypt.inverse();
+}
+
 class R4SDHC_DualCore : Flashcart {
 private:
+    static const uint8_t cmdReadFlash[8];
     static const uint8_t cmdEraseFlash[8];
     static const uint8_t cmdWriteByteFlash[8];
 
     static const uint8_t cmdUnkD0AA[8];
     static const uint8_t cmdUnkD0[8];
 
-    uint8_t decrypt(uint8_t enc) {
-        uint8_t dec = 0;
-        enc ^= 0x98;
-        if (enc & BIT(0)) dec |= BIT(6);
-        if (enc & BIT(1)) dec |= BIT(2);
-        if (enc & BIT(2)) dec |= BIT(7);
-        if (enc & BIT(3)) dec |= BIT(3);
-        if (enc & BIT(4)) dec |= BIT(1);
-        if (enc & BIT(5)) dec |= BIT(0);
-        if (enc & BIT(6)) dec |= BIT(4);
-        if (enc & BIT(7)) dec |= BIT(5);
-        return dec;
+    static const uint32_t block_size = 0x10000;
+
+    // The read command is the AK2i's (whose erase and program commands this cart shares), returning the
+    // flash scrambled. Nobody has confirmed it on hardware yet, so it's only trusted once something written
+    // through it reads back correctly; if that fails, writes go back to erasing and programming blindly.
+    enum class ReadPath { UNKNOWN, OK, BROKEN } m_read_path;
+
+    CommandBatch m_batch;
+
+    // queued in m_batch, outbuf is filled in (still scrambled) once it's sent
+    void read_cmd(uint8_t *outbuf, uint32_t address) {
+        uint8_t cmdbuf[8];
+        logMessage(LOG_DEBUG, "R4SDHC: read(0x%08x)", address);
+        memcpy(cmdbuf, cmdReadFlash, 8);
+        cmdbuf[1] = (address >> 24) & 0xFF;
+        cmdbuf[2] = (address >> 16) & 0xFF;
+        cmdbuf[3] = (address >>  8) & 0xFF;
+        cmdbuf[4] = (address >>  0) & 0xFF;
+
+        m_batch.add(cmdbuf, 0x200, outbuf, 2);
     }
 
-    uint8_t encrypt(uint8_t dec) {
-        uint8_t enc = 0;
-        if (dec & BIT(0)) enc |= BIT(5);
-        if (dec & BIT(1)) enc |= BIT(4);
-        if (dec & BIT(2)) enc |= BIT(1);
-        if (dec & BIT(3)) enc |= BIT(3);
-        if (dec & BIT(4)) enc |= BIT(6);
-        if (dec & BIT(5)) enc |= BIT(7);
-        if (dec & BIT(6)) enc |= BIT(0);
-        if (dec & BIT(7)) enc |= BIT(2);
-        enc ^= 0x98;
-        return enc;
+    void read_range(uint32_t address, uint32_t length, uint8_t *buffer, bool progress) {
+        uint8_t tail[0x200];
+
+        for (uint32_t curpos=0; curpos < length; curpos+=0x200) {
+            if (length - curpos >= 0x200) {
+                read_cmd(buffer + curpos, address + curpos);
+            } else {
+                read_cmd(tail, address + curpos);
+                m_batch.send();
+                memcpy(buffer + curpos, tail, length - curpos);
+            }
+            if (m_batch.size() >= 0x10) {
+                m_batch.send();
+                if (progress) showProgress(curpos + 0x200, length, "Reading");
+            }
+        }
+        m_batch.send();
+        r4sdhc_decrypt.apply(buffer, buffer, length);
     }
 
     void erase_cmd(uint32_t address) {
@@ -57,6 +78,7 @@ private:
         sendCommand(cmdbuf, 0, nullptr); // TODO: find IDB and get the latencies.
     }
 
+    // queued in m_batch
     void write_cmd(uint32_t address, uint8_t value) {
         uint8_t cmdbuf[8];
         logMessage(LOG_DEBUG, "R4SDHC: write(0x%08x) = 0x%02x", address, value);
@@ -66,16 +88,69 @@ private:
         cmdbuf[3] = (address >>  0) & 0xFF;
         cmdbuf[4] = value;
 
-        sendCommand(cmdbuf, 0, nullptr);
+        m_batch.add(cmdbuf, 0, nullptr);
+    }
+
+    EraseBlock eraseBlockAt(uint32_t address) {
+        if (address >= m_max_length) return {address, 0};
+        return {PAGE_ROUND_DOWN(address, block_size), block_size};
+    }
+
+    bool rmwRead(uint32_t address, uint32_t length, uint8_t *buffer) {
+        if (m_read_path == ReadPath::BROKEN) return false;
+        read_range(address, length, buffer, false);
+        return true;
+    }
+
+    bool rmwErase(const EraseBlock &block) {
+        erase_cmd(block.address);
+        return true;
+    }
+
+    // Until a program has read back correctly, a read that matches the data proves nothing, so
+    // writeBlocks erases and programs every block in full.
+    bool rmwReadTrusted() {
+        return m_read_path == ReadPath::OK;
+    }
+
+    // also checks what was programmed, which is how the read path gets trusted (or not)
+    bool rmwProgram(uint32_t address, uint32_t length, const uint8_t *data, const uint8_t *old) {
+        uint8_t check[0x200];
+
+        for (uint32_t i=0; i < length; i++) {
+            if (data[i] != (old ? old[i] : 0xFF)) write_cmd(address + i, data[i]);
+            if (m_batch.size() >= 0x100) m_batch.send();
+        }
+        m_batch.send();
+
+        for (uint32_t cur=0; cur < length; cur+=sizeof(check)) {
+            const uint32_t len = std::min<uint32_t>(sizeof(check), length - cur);
+            read_range(address + cur, len, check, false);
+            if (memcmp(check, data + cur, len)) {
+                if (m_read_path == ReadPath::OK) {
+                    logMessage(LOG_ERR, "R4SDHC: 0x%08x didn't verify", address + cur);
+                } else {
+                    m_read_path = ReadPath::BROKEN;
+                }
+                return false;
+            }
+        }
+        m_read_path = ReadPath::OK;
+        return true;
     }
 
 public:
     R4SDHC_DualCore() : Flashcart("R4 SDHC Dual Core", 0x400000) { }
 
+    uint32_t getWriteFlags() {
+        return m_read_path == ReadPath::OK ? WRITE_DIFFERENTIAL | WRITE_SKIPS_BLANK : 0;
+    }
+
     bool initialize() {
         uint8_t dummy[4];
 
         logMessage(LOG_INFO, "R4SDHC: Init");
+        m_read_path = ReadPath::UNKNOWN;
         sendCommand(cmdUnkD0AA, 4, dummy);
         sendCommand(cmdUnkD0, 0, nullptr);
         sendCommand(cmdUnkD0AA, 4, dummy);
@@ -88,21 +163,44 @@ public:
         logMessage(LOG_INFO, "R4SDHC: Shutdown");
     }
 
-    // We don't have a read command...
     bool readFlash(uint32_t address, uint32_t length, uint8_t *buffer) {
-        logMessage(LOG_ERR, "R4SDHC: readFlash not implemented!");
-        return false;
+        logMessage(LOG_INFO, "R4SDHC: readFlash(addr=0x%08x, size=0x%x)", address, length);
+        if (m_read_path == ReadPath::BROKEN) {
+            logMessage(LOG_ERR, "R4SDHC: reads don't return the flash on this cart");
+            return false;
+        }
+
+        if (readCacheEnabled()) return readCached(address, length, buffer, true);
+        read_range(address, length, buffer, true);
+        return true;
     }
 
     bool writeFlash(uint32_t address, uint32_t length, const uint8_t *buffer) {
         logMessage(LOG_INFO, "R4SDHC: writeFlash(addr=0x%08x, size=0x%x)", address, length);
-        for (uint32_t addr=0; addr < length; addr+=0x10000)
-            erase_cmd(address + addr);
+        if (m_read_path != ReadPath::BROKEN) {
+            if (writeBlocks(address, length, buffer)) {
+                return true;
+            }
+            if (m_read_path != ReadPath::BROKEN) {
+                return false;
+            }
+            // the reads are what's wrong, so don't trust anything written through them
+            logMessage(LOG_WARN, "R4SDHC: reads don't match what was written, writing blindly");
+        }
+
+        for (uint32_t addr=PAGE_ROUND_DOWN(address, block_size); addr < address + length; addr+=block_size) {
+            erase_cmd(addr);
+            invalidateReadCache(addr, block_size);
+        }
 
         for (uint32_t i=0; i < length; i++) {
             write_cmd(address + i, buffer[i]);
-            showProgress(i,length, "Writing");
+            if (m_batch.size() >= 0x100) {
+                m_batch.send();
+                showProgress(i,length, "Writing");
+            }
         }
+        m_batch.send();
 
         return true;
     }
@@ -117,6 +215,7 @@ public:
 const uint8_t R4SDHC_DualCore::cmdUnkD0AA[8] = {0xD0, 0xAA, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
 const uint8_t R4SDHC_DualCore::cmdUnkD0[8] = {0xD0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
 
+const uint8_t R4SDHC_DualCore::cmdReadFlash[8] = {0xB7, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00};
 const uint8_t R4SDHC_DualCore::cmdEraseFlash[8] = {0xD4, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00};
 const uint8_t R4SDHC_DualCore::cmdWriteByteFlash[8] = {0xD4, 0x00, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00};
 
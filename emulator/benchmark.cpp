@@ -0,0 +1,160 @@
+// Throughput benchmark: runs readFlash, writeFlash and injectNtrBoot for every
+// registered Flashcart against its emulated cart, and reports what it cost on
+// the (virtual) bus. Only built with FLASHCART_CORE_BENCHMARK; see README.md.
+
+#if defined(FLASHCART_CORE_EMULATOR) && defined(FLASHCART_CORE_BENCHMARK)
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "../device.h"
+#include "emulator.h"
+
+using namespace flashcart_core;
+
+namespace {
+struct Target {
+    const char *name; // Flashcart::getName()
+    const char *variant;
+    emulator::Cart *(*create)();
+    std::uint32_t firm_size;
+};
+
+const Target targets[] = {
+    {"Acekard 2i", "HW-44", [] { return emulator::createAK2i(0x44444444); }, 0x20000},
+    {"Acekard 2i", "HW-81", [] { return emulator::createAK2i(0x81818181); }, 0x20000},
+    {"R4i Gold 3DS", "type 1", [] { return emulator::createR4iGold3DS(0xA7A7A7A7); }, 0x20000},
+    {"R4i Gold 3DS", "type 2", [] { return emulator::createR4iGold3DS(0); }, 0x20000},
+    {"DSTT", "0xBAC2", [] { return emulator::createDSTT(0xBAC2); }, 0x8000},
+    {"DSTT", "0x80BF", [] { return emulator::createDSTT(0x80BF); }, 0x8000},
+    {"DSTT", "0x9189", [] { return emulator::createDSTT(0x9189); }, 0x8000},
+    {"DSTT", "0x4920", [] { return emulator::createDSTT(0x4920); }, 0x8000},
+    {"R4iSDHC family", "type 1", [] { return emulator::createR4iSDHC(1); }, 0x20000},
+    {"R4iSDHC family", "type 2", [] { return emulator::createR4iSDHC(2); }, 0x20000},
+};
+
+// Largest range writeFlash is benchmarked over; a full 16 MiB byte-program
+// tells us nothing a smaller one doesn't.
+const std::uint32_t max_write_length = 0x40000;
+
+struct Sample {
+    std::uint64_t start_ns;
+    std::uint64_t programs;
+    std::uint64_t erases;
+};
+
+Sample begin(emulator::Cart *cart) {
+    emulator::resetStats();
+    return {emulator::now(), cart->flash().programCount(), cart->flash().eraseCount()};
+}
+
+void report(const Target &target, const char *op, std::uint32_t length, const Sample &s, emulator::Cart *cart, bool ok) {
+    const emulator::Stats &stats = emulator::stats();
+    const double wall = (emulator::now() - s.start_ns) / 1e9;
+
+    std::printf("%-16s %-7s %-8s %9X %10llu %12llu %10.3f %10.3f %12.3f %8llu %6llu %s\n",
+        target.name, target.variant, op, length,
+        static_cast<unsigned long long>(stats.commands),
+        static_cast<unsigned long long>(stats.bytes_out + stats.bytes_in),
+        stats.bus_ns / 1e9, stats.delay_ns / 1e9, wall,
+        static_cast<unsigned long long>(cart->flash().programCount() - s.programs),
+        static_cast<unsigned long long>(cart->flash().eraseCount() - s.erases),
+        ok ? "ok" : "FAIL");
+}
+
+bool run(Flashcart *flashcart, const Target &target) {
+    emulator::Cart *cart = target.create();
+    emulator::insertCart(cart);
+
+    // Something other than blank flash, so differential writes have work to do (and, like a real
+    // cart's firmware, something for initialize() to probe against).
+    std::uint8_t *nor = cart->flash().data();
+    for (std::uint32_t i = 0; i < cart->flash().size(); ++i) {
+        nor[i] = static_cast<std::uint8_t>(i * 7 + (i >> 8));
+    }
+
+    if (!ntrcard::init() || !flashcart->initialize()) {
+        std::printf("%-16s %-7s initialize failed\n", target.name, target.variant);
+        emulator::insertCart(nullptr);
+        delete cart;
+        return false;
+    }
+
+    const std::uint32_t max_length = flashcart->getMaxLength();
+    std::vector<std::uint8_t> buf(max_length);
+    bool all_ok = true;
+
+    Sample s = begin(cart);
+    bool ok = flashcart->readFlash(0, max_length, buf.data()) && !std::memcmp(buf.data(), nor, max_length);
+    report(target, "read", max_length, s, cart, ok);
+    all_ok &= ok;
+
+    const std::uint32_t write_length = std::min(max_length, max_write_length);
+    for (std::uint32_t i = 0; i < write_length; ++i) {
+        buf[i] = static_cast<std::uint8_t>(std::rand());
+    }
+    s = begin(cart);
+    ok = flashcart->writeFlash(0, write_length, buf.data()) && !std::memcmp(buf.data(), nor, write_length);
+    report(target, "write", write_length, s, cart, ok);
+    all_ok &= ok;
+
+    // Writing the same data again is the best case for drivers that skip unchanged data.
+    s = begin(cart);
+    ok = flashcart->writeFlash(0, write_length, buf.data()) && !std::memcmp(buf.data(), nor, write_length);
+    report(target, "rewrite", write_length, s, cart, ok);
+    all_ok &= ok;
+
+    // injectNtrBoot output is cart-specific (and sometimes encrypted), so only its return value is checked.
+    std::vector<std::uint8_t> blowfish_key(0x1048), firm(target.firm_size);
+    for (auto &b : blowfish_key) b = static_cast<std::uint8_t>(std::rand());
+    for (auto &b : firm) b = static_cast<std::uint8_t>(std::rand());
+    s = begin(cart);
+    ok = flashcart->injectNtrBoot(blowfish_key.data(), firm.data(), target.firm_size);
+    report(target, "inject", target.firm_size, s, cart, ok);
+    all_ok &= ok;
+
+    s = begin(cart);
+    ok = flashcart->injectNtrBoot(blowfish_key.data(), firm.data(), target.firm_size);
+    report(target, "reinject", target.firm_size, s, cart, ok);
+    all_ok &= ok;
+
+    flashcart->shutdown();
+    emulator::insertCart(nullptr);
+    delete cart;
+    return all_ok;
+}
+}
+
+int main(int argc, char **argv) {
+    const char *only = argc > 1 ? argv[1] : nullptr;
+    bool all_ok = true;
+
+    std::printf("%-16s %-7s %-8s %9s %10s %12s %10s %10s %12s %8s %6s\n",
+        "cart", "variant", "op", "length", "commands", "bus bytes", "bus s", "ioDelay s", "est. wall s",
+        "programs", "erases");
+
+    for (Flashcart *flashcart : *flashcart_list) {
+        if (only && std::strcmp(only, flashcart->getName())) {
+            continue;
+        }
+
+        bool emulated = false;
+        for (const Target &target : targets) {
+            if (!std::strcmp(target.name, flashcart->getName())) {
+                emulated = true;
+                all_ok &= run(flashcart, target);
+            }
+        }
+
+        if (!emulated) {
+            std::printf("%-16s no emulated cart\n", flashcart->getName());
+        }
+    }
+
+    return all_ok ? 0 : 1;
+}
+
+#endif
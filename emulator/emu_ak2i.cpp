@@ -0,0 +1,92 @@
+#ifdef FLASHCART_CORE_EMULATOR
+
+#include <algorithm>
+#include <cstring>
+
+#include "emulator.h"
+
+namespace flashcart_core {
+namespace emulator {
+namespace {
+// Parallel NOR behind the AK2i ASIC: 64 KiB sectors, ~10 us byte program, ~0.7 s sector erase.
+const NorTiming ak2i_timing = {10000, 600000000, 1500000};
+
+class AK2i : public Cart {
+    const std::uint32_t m_hw_revision;
+    bool m_flash_unlocked;
+
+    // Longest read the ASIC clocks out of the flash; the rest of the transfer is all-FF. Differs between the
+    // revisions so both outcomes of the driver's read size probe get exercised.
+    std::uint16_t maxRead() const { return m_hw_revision == 0x81818181 ? 0x1000 : 0x200; }
+
+public:
+    AK2i(std::uint32_t hw_revision)
+        : Cart(0xFC2, NorFlash(hw_revision == 0x81818181 ? 0x1000000 : 0x200000, {0x10000}, ak2i_timing)),
+        m_hw_revision(hw_revision), m_flash_unlocked(false) { }
+
+    void reset() override {
+        m_flash_unlocked = false;
+    }
+
+    void command(const std::uint8_t *cmd, std::uint16_t len, std::uint8_t *resp, ntrcard::OpFlags flags) override {
+        std::uint32_t word = 0;
+
+        switch (cmd[0]) {
+            case 0xD1: // GetHWRevision
+                word = m_hw_revision;
+                break;
+            case 0xC0: // WaitFlashBusy
+                word = m_flash.busy() ? 1 : 0;
+                break;
+            case 0xC2:
+                if (cmd[1] == 0xAA && cmd[2] == 0x55 && cmd[3] == 0xAA && cmd[4] == 0x55) {
+                    m_flash_unlocked = true;
+                } else if (cmd[1] == 0xAA && cmd[2] == 0xAA && cmd[3] == 0x55 && cmd[4] == 0x55) {
+                    m_flash_unlocked = false;
+                }
+                break;
+            case 0xB7: { // ReadFlash
+                const std::uint32_t address = (cmd[1] << 24) | (cmd[2] << 16) | (cmd[3] << 8) | cmd[4];
+                if (resp) {
+                    std::memset(resp, 0xFF, len);
+                    m_flash.read(address % m_flash.size(), std::min(len, maxRead()), resp);
+                }
+                return;
+            }
+            case 0xD4: { // Erase / WriteByte
+                const std::uint32_t address = ((cmd[1] & (m_hw_revision == 0x81818181 ? 0xFF : 0x1F)) << 16) |
+                    (cmd[2] << 8) | cmd[3];
+                if (!m_flash_unlocked || m_flash.busy()) {
+                    break;
+                }
+                if (cmd[5] == 0x01 || cmd[5] == 0x80) {
+                    m_flash.eraseBlock(address);
+                } else if (cmd[5] == 0x03 || cmd[5] == 0xA0) {
+                    m_flash.program(address, cmd[4]);
+                }
+                break;
+            }
+            case 0xD0: // SetMapTableAddress
+            case 0xD8: // SetFlash1681_81
+                break;
+            default:
+                Cart::command(cmd, len, resp, flags);
+                return;
+        }
+
+        if (resp) {
+            for (std::uint16_t i = 0; i < len; ++i) {
+                resp[i] = static_cast<std::uint8_t>(word >> (8 * (i % 4)));
+            }
+        }
+    }
+};
+}
+
+Cart *createAK2i(std::uint32_t hw_revision) {
+    return new AK2i(hw_revision);
+}
+}
+}
+
+#endif
@@ -0,0 +1,313 @@
+#ifdef FLASHCART_CORE_EMULATOR
+
+#include <cstring>
+
+#include "emulator.h"
+
+namespace flashcart_core {
+namespace emulator {
+namespace {
+struct DSTTChip {
+    std::uint32_t id;
+    bool intel; // Intel/ST command set (DSTT_CMD_TYPE_2) rather than AMD/JEDEC
+    bool unlock_bypass;
+    bool cfi;
+    std::uint32_t size;
+    std::vector<std::uint32_t> blocks;
+    NorTiming timing;
+};
+
+// Geometry as the DSTT's bus sees it (i.e. matching the layouts in devices/dstt.cpp).
+const DSTTChip dstt_chips[] = {
+    {0xBAC2, false, true, true, 0x40000, {0x2000, 0x1000, 0x1000, 0x4000, 0x8000}, {9000, 700000000, 0}},
+    {0xC4C2, false, true, true, 0x200000, {0x8000, 0x2000, 0x2000, 0x4000, 0x10000}, {9000, 700000000, 0}},
+    {0x041F, false, false, false, 0x20000, {0x10000}, {30000, 1000000000, 0}},
+    {0x051F, false, false, false, 0x20000, {0x4000, 0x2000, 0x2000, 0x8000, 0x10000}, {30000, 1000000000, 0}},
+    {0x80BF, false, false, false, 0x20000, {0x800}, {20000, 18000000, 0}},
+    {0x9189, true, false, true, 0x200000, {0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x1000, 0x8000},
+        {12000, 1000000000, 0}},
+    // not in the driver's tables: only usable through its CFI query
+    {0x4920, false, true, true, 0x100000, {0x2000, 0x1000, 0x1000, 0x4000, 0x8000}, {10000, 800000000, 0}},
+};
+
+class DSTT : public Cart {
+    const DSTTChip &m_chip;
+
+    enum class Mode {
+        READ, UNLOCK1, UNLOCK2, AUTOSELECT, PROGRAM, ERASE_SETUP, ERASE_UNLOCK1, ERASE_UNLOCK2, // AMD
+        BYPASS, BYPASS_PROGRAM, BYPASS_RESET, // AMD unlock bypass
+        ARRAY, STATUS, ID, INTEL_PROGRAM, INTEL_ERASE, // Intel
+        CFI
+    } m_mode;
+    std::uint8_t m_intel_sr;
+    std::uint8_t m_last_program;
+    bool m_toggle;
+
+    // CFI query table, describing the chip as the bus sees it (all zero if the chip has none)
+    std::uint8_t m_cfi[0x60];
+
+    static std::uint8_t log2Ceil(std::uint64_t x) {
+        std::uint8_t n = 0;
+        while ((1ull << n) < x) {
+            ++n;
+        }
+        return n;
+    }
+
+    void buildCfi() {
+        std::memset(m_cfi, 0, sizeof(m_cfi));
+        if (!m_chip.cfi) {
+            return;
+        }
+
+        std::memcpy(m_cfi + 0x10, "QRY", 3);
+        m_cfi[0x13] = m_chip.intel ? 0x03 : 0x02;
+        if (!m_chip.intel) {
+            // primary extended table v1.1, bottom boot
+            m_cfi[0x15] = 0x40;
+            std::memcpy(m_cfi + 0x40, "PRI11", 5);
+            m_cfi[0x4F] = 2;
+        }
+
+        const NorTiming &timing = m_flash.timing();
+        m_cfi[0x1F] = log2Ceil(timing.program_ns / 1000);
+        m_cfi[0x21] = log2Ceil(timing.erase_ns / 1000000);
+        m_cfi[0x22] = log2Ceil(timing.erase_ns / 1000000 * m_flash.blockStarts().size());
+        m_cfi[0x23] = m_cfi[0x25] = m_cfi[0x26] = 4;
+        m_cfi[0x27] = log2Ceil(m_flash.size());
+        m_cfi[0x28] = 2; // x8/x16
+
+        std::uint8_t regions = 0;
+        const std::vector<std::uint32_t> &starts = m_flash.blockStarts();
+        for (std::size_t i = 0; i < starts.size() && regions < 4;) {
+            const std::uint32_t block_sz = m_flash.blockSize(starts[i]);
+            std::size_t n = 1;
+            while (i + n < starts.size() && m_flash.blockSize(starts[i + n]) == block_sz) {
+                ++n;
+            }
+            std::uint8_t *r = m_cfi + 0x2D + regions++ * 4;
+            r[0] = static_cast<std::uint8_t>(n - 1);
+            r[1] = static_cast<std::uint8_t>((n - 1) >> 8);
+            r[2] = static_cast<std::uint8_t>(block_sz >> 8);
+            r[3] = static_cast<std::uint8_t>(block_sz >> 16);
+            i += n;
+        }
+        m_cfi[0x2C] = regions;
+    }
+
+    static bool isUnlock1(std::uint32_t addr) { return (addr & 0x7FF) == 0x555; }
+    static bool isUnlock2(std::uint32_t addr) { return (addr & 0x7FF) == 0x2AA; }
+
+    void writeAMD(std::uint32_t addr, std::uint8_t data) {
+        if (m_flash.busy()) {
+            return; // the embedded algorithm ignores the bus until it's done
+        }
+        const bool bypass = m_mode == Mode::BYPASS || m_mode == Mode::BYPASS_PROGRAM || m_mode == Mode::BYPASS_RESET;
+        if (data == 0xF0 && m_mode != Mode::PROGRAM && !bypass) {
+            m_mode = Mode::READ;
+            return;
+        }
+
+        switch (m_mode) {
+            case Mode::READ:
+            case Mode::AUTOSELECT:
+                if ((addr & 0x7FF) == 0x55 && data == 0x98 && m_chip.cfi) {
+                    m_mode = Mode::CFI;
+                } else {
+                    m_mode = (isUnlock1(addr) && data == 0xAA) ? Mode::UNLOCK1 : m_mode;
+                }
+                break;
+            case Mode::UNLOCK1:
+                m_mode = (isUnlock2(addr) && data == 0x55) ? Mode::UNLOCK2 : Mode::READ;
+                break;
+            case Mode::UNLOCK2:
+                m_mode = Mode::READ;
+                if (isUnlock1(addr)) {
+                    if (data == 0x90) {
+                        m_mode = Mode::AUTOSELECT;
+                    } else if (data == 0xA0) {
+                        m_mode = Mode::PROGRAM;
+                    } else if (data == 0x80) {
+                        m_mode = Mode::ERASE_SETUP;
+                    } else if (data == 0x20 && m_chip.unlock_bypass) {
+                        m_mode = Mode::BYPASS;
+                    }
+                }
+                break;
+            case Mode::BYPASS:
+                // only programs and the two cycle exit sequence are accepted
+                m_mode = data == 0xA0 ? Mode::BYPASS_PROGRAM : (data == 0x90 ? Mode::BYPASS_RESET : Mode::BYPASS);
+                break;
+            case Mode::BYPASS_PROGRAM:
+                m_last_program = data;
+                m_flash.program(addr, data);
+                m_mode = Mode::BYPASS;
+                break;
+            case Mode::BYPASS_RESET:
+                m_mode = data == 0x00 ? Mode::READ : Mode::BYPASS;
+                break;
+            case Mode::PROGRAM:
+                m_last_program = data;
+                m_flash.program(addr, data);
+                m_mode = Mode::READ;
+                break;
+            case Mode::ERASE_SETUP:
+                m_mode = (isUnlock1(addr) && data == 0xAA) ? Mode::ERASE_UNLOCK1 : Mode::READ;
+                break;
+            case Mode::ERASE_UNLOCK1:
+                m_mode = (isUnlock2(addr) && data == 0x55) ? Mode::ERASE_UNLOCK2 : Mode::READ;
+                break;
+            case Mode::ERASE_UNLOCK2:
+                if (data == 0x30) {
+                    m_flash.eraseBlock(addr);
+                } else if (data == 0x10 && isUnlock1(addr)) {
+                    m_flash.eraseChip();
+                }
+                m_mode = Mode::READ;
+                break;
+            default:
+                m_mode = Mode::READ;
+                break;
+        }
+    }
+
+    void writeIntel(std::uint32_t addr, std::uint8_t data) {
+        switch (m_mode) {
+            case Mode::INTEL_PROGRAM:
+                m_flash.program(addr, data);
+                m_mode = Mode::STATUS;
+                return;
+            case Mode::INTEL_ERASE:
+                if (data == 0xD0) {
+                    m_flash.eraseBlock(addr);
+                } else {
+                    m_intel_sr |= 0x30; // command sequence error
+                }
+                m_mode = Mode::STATUS;
+                return;
+            default:
+                break;
+        }
+
+        switch (data) {
+            case 0x50:
+                m_intel_sr = 0;
+                break;
+            case 0x70:
+                m_mode = Mode::STATUS;
+                break;
+            case 0x90:
+                m_mode = Mode::ID;
+                break;
+            case 0x98:
+                m_mode = m_chip.cfi ? Mode::CFI : Mode::ARRAY;
+                break;
+            case 0x40:
+            case 0x10:
+                m_mode = Mode::INTEL_PROGRAM;
+                break;
+            case 0x20:
+                m_mode = Mode::INTEL_ERASE;
+                break;
+            default: // 0xFF, and anything we don't understand
+                m_mode = Mode::ARRAY;
+                break;
+        }
+    }
+
+    std::uint32_t read(std::uint32_t addr) {
+        std::uint8_t status;
+
+        if (m_mode == Mode::AUTOSELECT || m_mode == Mode::ID) {
+            return m_chip.id;
+        }
+        if (m_mode == Mode::CFI) {
+            std::uint32_t word = 0;
+            for (std::uint32_t i = 0; i < 4 && addr + i < sizeof(m_cfi); ++i) {
+                word |= m_cfi[addr + i] << (8 * i);
+            }
+            return word;
+        }
+
+        if (m_chip.intel) {
+            if (m_mode != Mode::STATUS) {
+                std::uint32_t word;
+                m_flash.read(addr, 4, reinterpret_cast<std::uint8_t *>(&word));
+                return word;
+            }
+            status = m_intel_sr | (m_flash.busy() ? 0 : 0x80);
+        } else {
+            if (!m_flash.busy()) {
+                std::uint32_t word;
+                m_flash.read(addr, 4, reinterpret_cast<std::uint8_t *>(&word));
+                return word;
+            }
+            // DQ7 = complement of the data being programmed (0 while erasing), DQ6 toggles, DQ3 = erase started
+            m_toggle = !m_toggle;
+            status = (m_toggle ? 0x40 : 0) | (m_flash.erasing() ? 0x08 : (~m_last_program & 0x80));
+        }
+
+        return status * 0x01010101u;
+    }
+
+public:
+    DSTT(const DSTTChip &chip)
+        : Cart(0xFC2, NorFlash(chip.size, chip.blocks, chip.timing)), m_chip(chip),
+        m_mode(chip.intel ? Mode::ARRAY : Mode::READ), m_intel_sr(0), m_last_program(0xFF), m_toggle(false) {
+        buildCfi();
+    }
+
+    void reset() override {
+        m_mode = m_chip.intel ? Mode::ARRAY : Mode::READ;
+        m_intel_sr = 0;
+    }
+
+    void command(const std::uint8_t *cmd, std::uint16_t len, std::uint8_t *resp, ntrcard::OpFlags flags) override {
+        const std::uint32_t addr = (cmd[1] << 24) | (cmd[2] << 16) | (cmd[3] << 8) | cmd[4];
+        const std::uint16_t data = (cmd[5] << 8) | cmd[6];
+        std::uint32_t word = 0;
+
+        switch (cmd[0]) {
+            case 0x86: // init
+            case 0x88: // shutdown
+                break;
+            case 0x87: // flash bus write cycle
+                if (m_chip.intel) {
+                    writeIntel(addr, static_cast<std::uint8_t>(data));
+                } else {
+                    writeAMD(addr, static_cast<std::uint8_t>(data));
+                }
+                break;
+            case 0x00:
+                if (len == 0x1000) {
+                    Cart::command(cmd, len, resp, flags);
+                    return;
+                }
+                word = read(addr);
+                break;
+            default:
+                Cart::command(cmd, len, resp, flags);
+                return;
+        }
+
+        if (resp) {
+            for (std::uint16_t i = 0; i < len; ++i) {
+                resp[i] = static_cast<std::uint8_t>(word >> (8 * (i % 4)));
+            }
+        }
+    }
+};
+}
+
+Cart *createDSTT(std::uint32_t flashchip) {
+    for (const DSTTChip &chip : dstt_chips) {
+        if (chip.id == flashchip) {
+            return new DSTT(chip);
+        }
+    }
+    return nullptr;
+}
+}
+}
+
+#endif
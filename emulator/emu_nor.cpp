@@ -0,0 +1,83 @@
+#ifdef FLASHCART_CORE_EMULATOR
+
+#include <algorithm>
+#include <cstring>
+
+#include "emulator.h"
+
+namespace flashcart_core {
+namespace emulator {
+NorFlash::NorFlash(std::uint32_t size, const std::vector<std::uint32_t> &blocks, const NorTiming &timing)
+    : m_data(size, 0xFF), m_timing(timing), m_busy_until(0), m_erasing(false), m_programs(0), m_erases(0) {
+    std::uint32_t addr = 0;
+    std::size_t i = 0;
+    while (addr < size) {
+        m_block_starts.push_back(addr);
+        addr += blocks[std::min(i++, blocks.size() - 1)];
+    }
+}
+
+std::uint32_t NorFlash::blockStart(std::uint32_t address) const {
+    auto it = std::upper_bound(m_block_starts.begin(), m_block_starts.end(), address);
+    return *(it - 1);
+}
+
+std::uint32_t NorFlash::blockSize(std::uint32_t address) const {
+    auto it = std::upper_bound(m_block_starts.begin(), m_block_starts.end(), address);
+    return (it == m_block_starts.end() ? size() : *it) - *(it - 1);
+}
+
+bool NorFlash::busy() const {
+    return now() < m_busy_until;
+}
+
+void NorFlash::goBusy(std::uint64_t ns, bool erasing) {
+    m_busy_until = now() + ns;
+    m_erasing = erasing;
+}
+
+std::uint8_t NorFlash::read(std::uint32_t address) const {
+    return address < size() ? m_data[address] : 0xFF;
+}
+
+void NorFlash::read(std::uint32_t address, std::uint32_t length, std::uint8_t *out) const {
+    for (std::uint32_t i = 0; i < length; ++i) {
+        out[i] = read(address + i);
+    }
+}
+
+void NorFlash::program(std::uint32_t address, std::uint8_t value) {
+    program(address, 1, &value);
+}
+
+void NorFlash::program(std::uint32_t address, std::uint32_t length, const std::uint8_t *values) {
+    for (std::uint32_t i = 0; i < length; ++i) {
+        if (address + i < size()) {
+            m_data[address + i] &= values[i];
+        }
+    }
+    ++m_programs;
+    goBusy(m_timing.program_ns, false);
+}
+
+void NorFlash::eraseBlock(std::uint32_t address) {
+    if (address >= size()) {
+        return;
+    }
+    eraseRange(blockStart(address), blockSize(address));
+}
+
+void NorFlash::eraseRange(std::uint32_t address, std::uint32_t length) {
+    length = std::min(length, size() - std::min(address, size()));
+    std::memset(m_data.data() + address, 0xFF, length);
+    ++m_erases;
+    goBusy(m_timing.erase_ns + (length >> 10) * m_timing.erase_kib_ns, true);
+}
+
+void NorFlash::eraseChip() {
+    eraseRange(0, size());
+}
+}
+}
+
+#endif
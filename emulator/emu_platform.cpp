@@ -0,0 +1,294 @@
+// platform.h implementation backed by an emulated cart. See emulator.h.
+
+#ifdef FLASHCART_CORE_EMULATOR
+
+#include <cstring>
+
+#include "../platform.h"
+#include "emulator.h"
+
+namespace flashcart_core {
+namespace emulator {
+namespace {
+// The NTR bus runs at 33.513982 MHz / 5 (or / 8 with ROMCNT_CLK_SLOW), one byte per clock.
+constexpr std::uint64_t ns_per_cycles(std::uint64_t cycles) { return cycles * 1000000000ull / 33513982ull; }
+
+Cart *cart = nullptr;
+std::uint64_t clock_ns = 0;
+std::uint64_t command_overhead_ns = 1000;
+Stats current_stats = {};
+
+// The DS side of hardware KEY2, seeded by platform::initKey2Seed.
+Key2Stream hw_key2;
+bool hw_key2_seeded = false;
+
+const std::uint32_t header_game_code = 0x23232323; // "####"
+
+// KEY1 as the cart runs it; the same Blowfish as ntrcard.cpp, with the table from our initBlowfishPS.
+void blowfish_encrypt(const std::uint32_t (&ps)[ntrcard::BLOWFISH_PS_N], std::uint32_t lr[2]) {
+    std::uint32_t x = lr[1], y = lr[0];
+    for (int i = 0; i < 0x10; ++i) {
+        const std::uint32_t z = ps[i] ^ x;
+        x = ps[0x012 + ((z >> 24) & 0xFF)];
+        x = ps[0x112 + ((z >> 16) & 0xFF)] + x;
+        x = ps[0x212 + ((z >> 8) & 0xFF)] ^ x;
+        x = ps[0x312 + (z & 0xFF)] + x;
+        x = y ^ x;
+        y = z;
+    }
+    lr[0] = x ^ ps[0x10];
+    lr[1] = y ^ ps[0x11];
+}
+
+void blowfish_decrypt(const std::uint32_t (&ps)[ntrcard::BLOWFISH_PS_N], std::uint32_t lr[2]) {
+    std::uint32_t x = lr[1], y = lr[0];
+    for (int i = 0x11; i > 1; --i) {
+        const std::uint32_t z = ps[i] ^ x;
+        x = ps[0x012 + ((z >> 24) & 0xFF)];
+        x = ps[0x112 + ((z >> 16) & 0xFF)] + x;
+        x = ps[0x212 + ((z >> 8) & 0xFF)] ^ x;
+        x = ps[0x312 + (z & 0xFF)] + x;
+        x = y ^ x;
+        y = z;
+    }
+    lr[0] = x ^ ps[1];
+    lr[1] = y ^ ps[0];
+}
+
+void blowfish_apply_key(std::uint32_t (&ps)[ntrcard::BLOWFISH_PS_N], std::uint32_t key[3]) {
+    std::uint32_t scratch[2] = {0};
+    blowfish_encrypt(ps, key + 1);
+    blowfish_encrypt(ps, key);
+    for (std::uint32_t i = 0; i < ntrcard::BLOWFISH_P_N; ++i) {
+        ps[i] ^= __builtin_bswap32(key[i % 2]);
+    }
+    for (std::uint32_t i = 0; i < ntrcard::BLOWFISH_PS_N; i += 2) {
+        blowfish_encrypt(ps, scratch);
+        ps[i] = scratch[1];
+        ps[i + 1] = scratch[0];
+    }
+}
+}
+
+std::uint64_t now() { return clock_ns; }
+void advance(std::uint64_t ns) { clock_ns += ns; }
+
+void setCommandOverhead(std::uint64_t ns) { command_overhead_ns = ns; }
+
+void insertCart(Cart *c) { cart = c; }
+Cart *insertedCart() { return cart; }
+
+const Stats &stats() { return current_stats; }
+void resetStats() { current_stats = Stats(); }
+
+void Cart::command(const std::uint8_t *cmd, std::uint16_t len, std::uint8_t *resp, ntrcard::OpFlags flags) {
+    if (!rawCommand(cmd, len, resp) && resp) {
+        std::memset(resp, 0xFF, len);
+    }
+}
+
+void Key2Stream::apply(std::uint8_t *data, std::size_t len) {
+    // Unlike ntrcard::Key2, the registers aren't bit-reversed: each shifts right, feeding the XOR of
+    // bits 0, 13, 14 and 26 (X) or 0, 8, 13 and 26 (Y) in at bit 38, and the top 8 bits, lowest
+    // last, are the keystream byte.
+    const std::uint64_t mask = 0x7FFFFFFFFFull;
+    for (std::size_t i = 0; i < len; ++i) {
+        for (int b = 0; b < 8; ++b) {
+            const std::uint64_t fx = (m_x ^ (m_x >> 13) ^ (m_x >> 14) ^ (m_x >> 26)) & 1;
+            const std::uint64_t fy = (m_y ^ (m_y >> 8) ^ (m_y >> 13) ^ (m_y >> 26)) & 1;
+            m_x = ((m_x >> 1) | (fx << 38)) & mask;
+            m_y = ((m_y >> 1) | (fy << 38)) & mask;
+        }
+        std::uint8_t key = 0;
+        for (int b = 0; b < 8; ++b) {
+            key |= (((m_x ^ m_y) >> (38 - b)) & 1) << b;
+        }
+        if (data) {
+            data[i] ^= key;
+        }
+    }
+}
+
+bool Cart::secureCommand(const std::uint8_t *cmd, std::uint16_t len, std::uint8_t *resp, std::uint8_t (&plain)[8]) {
+    if (m_security == Security::RAW) {
+        if (cmd[0] != 0x3C) {
+            return false;
+        }
+        std::uint32_t key[3] = {header_game_code, header_game_code >> 1, header_game_code << 1};
+        platform::initBlowfishPS(m_key1_ps, ntrcard::BlowfishKey::NTR);
+        blowfish_apply_key(m_key1_ps, key);
+        blowfish_apply_key(m_key1_ps, key);
+        m_security = Security::KEY1;
+        m_key2_seeded = false;
+        return false;
+    }
+
+    std::uint32_t response = 0xFFFFFFFF;
+    if (m_security == Security::KEY1) {
+        // undo key1_cmdf: the command is byte-swapped around the Blowfish block
+        std::uint64_t block;
+        std::memcpy(&block, cmd, 8);
+        block = __builtin_bswap64(block);
+        std::uint32_t lr[2] = {static_cast<std::uint32_t>(block), static_cast<std::uint32_t>(block >> 32)};
+        blowfish_decrypt(m_key1_ps, lr);
+        const std::uint64_t p = __builtin_bswap64(lr[0] | (static_cast<std::uint64_t>(lr[1]) << 32));
+
+        switch ((p >> 4) & 0xF) {
+            case 0x4: { // init KEY2, with the seed in the IJ field
+                static const std::uint8_t seed_bytes[8] = {0xE8, 0x4D, 0x5A, 0xB1, 0x17, 0x8F, 0x99, 0xD5};
+                const std::uint64_t mn = (((p >> 16) & 0xF) << 20) | (((p >> 24) & 0xFF) << 12) |
+                    (((p >> 32) & 0xFF) << 4) | ((p >> 44) & 0xF);
+                // byte 0x13 of our header is 0
+                m_key2.seed(seed_bytes[0] + (mn << 15) + 0x6000, 0x5C879B9B05ull);
+                m_key2_seeded = true;
+                break;
+            }
+            case 0x1:
+                response = m_chipid;
+                break;
+            case 0xA:
+                m_security = Security::KEY2;
+                break;
+        }
+    } else {
+        std::memcpy(plain, cmd, 8);
+        m_key2.apply(plain, 8);
+        if (plain[0] != 0xB8) {
+            return true;
+        }
+        response = m_chipid;
+    }
+
+    if (resp) {
+        for (std::uint16_t i = 0; i < len; ++i) {
+            resp[i] = static_cast<std::uint8_t>(response >> (8 * (i % 4)));
+        }
+    }
+    if (m_key2_seeded) {
+        m_key2.apply(resp, len);
+    }
+    return false;
+}
+
+bool Cart::rawCommand(const std::uint8_t *cmd, std::uint16_t len, std::uint8_t *resp) {
+    switch (cmd[0]) {
+        case 0x9F:
+            if (resp) {
+                std::memset(resp, 0xFF, len);
+            }
+            return true;
+        case 0x90:
+            if (resp) {
+                for (std::uint16_t i = 0; i < len; ++i) {
+                    resp[i] = static_cast<std::uint8_t>(m_chipid >> (8 * (i % 4)));
+                }
+            }
+            return true;
+        case 0x00:
+            if (len != 0x1000) {
+                return false;
+            }
+            if (resp) {
+                std::memset(resp, 0, len);
+                std::memcpy(resp + 0xC, "####", 4);
+                const std::uint32_t key2_romcnt = 0x00416657, key1_romcnt = 0x081808F8;
+                std::memcpy(resp + 0x60, &key2_romcnt, 4);
+                std::memcpy(resp + 0x64, &key1_romcnt, 4);
+            }
+            return true;
+    }
+    return false;
+}
+}
+
+namespace platform {
+using emulator::cart;
+using emulator::current_stats;
+
+#ifdef FLASHCART_CORE_EMULATOR_SW_KEY2
+extern const bool HAS_HW_KEY2 = false;
+#else
+extern const bool HAS_HW_KEY2 = true;
+#endif
+extern const bool CAN_RESET = true;
+
+std::int32_t resetCard() {
+    if (!cart) {
+        return -1;
+    }
+    cart->reset();
+    emulator::hw_key2_seeded = false;
+    return 0;
+}
+
+namespace {
+bool transfer(const std::uint8_t *cmdbuf, std::uint16_t response_len, std::uint8_t *resp, ntrcard::OpFlags flags) {
+    const std::uint64_t bus_ns = emulator::ns_per_cycles((8 + response_len) * (flags.slow_clock() ? 8 : 5) +
+        flags.pre_delay() + flags.post_delay());
+
+    current_stats.commands++;
+    current_stats.bytes_out += 8;
+    current_stats.bytes_in += response_len;
+    current_stats.bus_ns += bus_ns;
+    emulator::advance(bus_ns);
+
+    if (!cart) {
+        if (resp) {
+            std::memset(resp, 0xFF, response_len);
+        }
+        return false;
+    }
+
+    std::uint8_t enc_cmdbuf[8];
+    if (emulator::hw_key2_seeded && flags.key2_command()) {
+        std::memcpy(enc_cmdbuf, cmdbuf, sizeof(enc_cmdbuf));
+        emulator::hw_key2.apply(enc_cmdbuf, sizeof(enc_cmdbuf));
+        cmdbuf = enc_cmdbuf;
+    }
+    cart->command(cmdbuf, response_len, resp, flags);
+    if (emulator::hw_key2_seeded && flags.key2_response()) {
+        emulator::hw_key2.apply(resp, response_len);
+    }
+    return true;
+}
+}
+
+bool sendCommand(const std::uint8_t *cmdbuf, std::uint16_t response_len, std::uint8_t *resp, ntrcard::OpFlags flags) {
+    emulator::advance(emulator::command_overhead_ns);
+    return transfer(cmdbuf, response_len, resp, flags);
+}
+
+// Models a platform with a command FIFO: the host-side overhead is paid once per batch.
+bool sendCommands(const ntrcard::Command *cmds, std::size_t count) {
+    bool ret = true;
+    emulator::advance(emulator::command_overhead_ns);
+    for (std::size_t i = 0; i < count; ++i) {
+        ret = transfer(cmds[i].cmdbuf, cmds[i].response_len, cmds[i].resp, cmds[i].flags) && ret;
+    }
+    return ret;
+}
+
+void ioDelay(std::uint32_t us) {
+    current_stats.delay_ns += us * 1000ull;
+    emulator::advance(us * 1000ull);
+}
+
+void initBlowfishPS(std::uint32_t (&ps)[ntrcard::BLOWFISH_PS_N], ntrcard::BlowfishKey key) {
+    // Not the real keys, but any table works as long as both ends agree on it.
+    std::uint32_t x = 0x243F6A88 + static_cast<std::uint32_t>(key);
+    for (std::uint32_t i = 0; i < ntrcard::BLOWFISH_PS_N; ++i) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        ps[i] = x;
+    }
+}
+
+void initKey2Seed(std::uint64_t x, std::uint64_t y) {
+    emulator::hw_key2.seed(x, y);
+    emulator::hw_key2_seeded = true;
+}
+}
+}
+
+#endif
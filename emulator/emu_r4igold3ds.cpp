@@ -0,0 +1,70 @@
+#ifdef FLASHCART_CORE_EMULATOR
+
+#include <cstring>
+
+#include "emulator.h"
+
+namespace flashcart_core {
+namespace emulator {
+namespace {
+// Parallel NOR, 64 KiB sectors; same class of part as the AK2i's.
+const NorTiming r4i_gold_timing = {10000, 600000000, 1500000};
+
+class R4i_Gold_3DS : public Cart {
+    const std::uint32_t m_hw_revision;
+
+public:
+    R4i_Gold_3DS(std::uint32_t hw_revision)
+        : Cart(0xFC2, NorFlash(hw_revision ? 0x400000 : 0x200000, {0x10000}, r4i_gold_timing)),
+        m_hw_revision(hw_revision) { }
+
+    void command(const std::uint8_t *cmd, std::uint16_t len, std::uint8_t *resp, ntrcard::OpFlags flags) override {
+        const std::uint32_t address = (cmd[1] << 16) | (cmd[2] << 8) | cmd[3];
+        std::uint32_t word = 0;
+
+        switch (cmd[0]) {
+            case 0xD1: // GetHWRevision
+                word = m_hw_revision;
+                break;
+            case 0xC7: // Unknown
+                word = 0;
+                break;
+            case 0xC0: // WaitFlashBusy
+                word = m_flash.busy() ? 1 : 0;
+                break;
+            case 0xA5: // ReadFlash
+                if (resp) {
+                    m_flash.read(address % m_flash.size(), len, resp);
+                }
+                return;
+            case 0xDA: // Erase / WriteByte
+                if (m_flash.busy()) {
+                    break;
+                }
+                if (cmd[5] == 0xA5) {
+                    m_flash.eraseBlock(address);
+                } else if (cmd[5] == 0x5A) {
+                    m_flash.program(address, cmd[4]);
+                }
+                break;
+            default:
+                Cart::command(cmd, len, resp, flags);
+                return;
+        }
+
+        if (resp) {
+            for (std::uint16_t i = 0; i < len; ++i) {
+                resp[i] = static_cast<std::uint8_t>(word >> (8 * (i % 4)));
+            }
+        }
+    }
+};
+}
+
+Cart *createR4iGold3DS(std::uint32_t hw_revision) {
+    return new R4i_Gold_3DS(hw_revision);
+}
+}
+}
+
+#endif
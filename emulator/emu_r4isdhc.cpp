@@ -0,0 +1,216 @@
+#ifdef FLASHCART_CORE_EMULATOR
+
+#include <algorithm>
+#include <cstring>
+
+#include "emulator.h"
+
+namespace flashcart_core {
+namespace emulator {
+namespace {
+// 16 Mbit SPI NOR (MX25L1606E-like): 0.7 ms page program, 40 ms 4K / 400 ms 64K erase.
+const NorTiming r4isdhc_timing = {700000, 16000000, 6000000};
+const std::uint8_t r4isdhc_jedec_id[3] = {0xC2, 0x20, 0x15};
+// SFDP: header, one parameter header, and a JESD216B basic flash parameter table at 0x30.
+// 16 Mbit; erase types 4K (0x20), 32K (0x52), 64K (0xD8); 256 byte pages.
+const std::uint32_t r4isdhc_sfdp_bfpt[16] = {
+    0xFFF120E5, 0x00FFFFFF, 0x6B08EB44, 0x3B04BB08, 0xFFFFFFEE, 0xFF00FFFF, 0xFF00FFFF, 0x520F200C,
+    0xFF00D810, 0x00000000, 0x00000080, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+};
+
+// The FPGA stops clocking the NOR after this many bytes of a read; the rest of the transfer is all-FF.
+const std::uint16_t r4isdhc_max_read_burst = 0x200;
+
+class R4iSDHC : public Cart {
+    int m_type;
+    bool m_passthrough;
+    bool m_wel;
+    bool m_page_program;
+    std::uint32_t m_pp_address;
+    std::vector<std::uint8_t> m_pp_data;
+
+    void commitPageProgram() {
+        // A page program wraps around within its 256 byte page.
+        const std::uint32_t page = m_pp_address & ~0xFFu;
+        std::uint8_t page_data[0x100];
+        std::memset(page_data, 0xFF, sizeof(page_data));
+        for (std::size_t i = 0; i < m_pp_data.size(); ++i) {
+            page_data[(m_pp_address + i) & 0xFF] &= m_pp_data[i];
+        }
+        m_flash.program(page, sizeof(page_data), page_data);
+        m_page_program = false;
+        m_wel = false;
+    }
+
+    void norCommand(const std::uint8_t *cmd, std::uint16_t len, std::uint8_t *resp) {
+        const std::uint8_t inlen = cmd[1] & 0xF;
+        const std::uint8_t op = cmd[2];
+        const std::uint32_t address = ((cmd[3] << 16) | (cmd[4] << 8) | cmd[5]) % m_flash.size();
+
+        if (resp) {
+            std::memset(resp, 0, len);
+        }
+
+        if (inlen == 0) {
+            // continuation of a page program (norRaw); 0xF0 deasserts CS
+            if (m_page_program) {
+                if (cmd[1] == 0xF0) {
+                    commitPageProgram();
+                } else {
+                    m_pp_data.push_back(cmd[2]);
+                    m_pp_data.push_back(cmd[3]);
+                }
+            }
+            return;
+        }
+
+        if (m_flash.busy()) {
+            // only RDSR is answered while an erase/program is in progress
+            if (op == 0x05 && resp) {
+                std::memset(resp, 0x03, len);
+            } else if (resp) {
+                std::memset(resp, 0xFF, len);
+            }
+            return;
+        }
+
+        switch (op) {
+            case 0x06: // WREN
+                m_wel = true;
+                break;
+            case 0x04: // WRDI
+                m_wel = false;
+                break;
+            case 0x05: // RDSR
+                if (resp) {
+                    std::memset(resp, m_wel ? 0x02 : 0x00, len);
+                }
+                break;
+            case 0x5A: // RDSFDP
+                if (resp) {
+                    std::uint8_t sfdp[0x70];
+                    std::memset(sfdp, 0xFF, sizeof(sfdp));
+                    std::memcpy(sfdp, "SFDP\x06\x01\x00\xFF", 8);
+                    std::memcpy(sfdp + 8, "\x00\x06\x01\x10\x30\x00\x00\xFF", 8);
+                    std::memcpy(sfdp + 0x30, r4isdhc_sfdp_bfpt, sizeof(r4isdhc_sfdp_bfpt));
+                    for (std::uint16_t i = 0; i < len; ++i) {
+                        resp[i] = address + i < sizeof(sfdp) ? sfdp[address + i] : 0xFF;
+                    }
+                }
+                break;
+            case 0x9F: // RDID
+                if (resp) {
+                    std::memcpy(resp, r4isdhc_jedec_id, std::min<std::size_t>(len, sizeof(r4isdhc_jedec_id)));
+                }
+                break;
+            case 0x03: // READ
+            case 0x0B: // FAST_READ
+            case 0x3B: // DREAD
+                if (resp) {
+                    std::memset(resp, 0xFF, len);
+                    m_flash.read(address, std::min(len, r4isdhc_max_read_burst), resp);
+                }
+                break;
+            case 0x20: // SE (4K)
+            case 0x52: // BE (32K)
+            case 0xD8: // BE (64K)
+                if (m_wel) {
+                    const std::uint32_t size = op == 0x20 ? 0x1000 : (op == 0x52 ? 0x8000 : 0x10000);
+                    m_flash.eraseRange(address & ~(size - 1), size);
+                    m_wel = false;
+                }
+                break;
+            case 0x60: // CE
+            case 0xC7:
+                if (m_wel) {
+                    m_flash.eraseChip();
+                    m_wel = false;
+                }
+                break;
+            case 0x02: // PP
+                if (m_wel) {
+                    m_page_program = true;
+                    m_pp_address = address;
+                    m_pp_data.clear();
+                    for (std::uint8_t i = 4; i < inlen && i < 6; ++i) {
+                        m_pp_data.push_back(cmd[2 + i]);
+                    }
+                }
+                break;
+        }
+    }
+
+public:
+    explicit R4iSDHC(int type) : Cart(0xFC2, NorFlash(0x200000, {0x1000}, r4isdhc_timing)),
+        m_type(type), m_passthrough(false), m_wel(false), m_page_program(false), m_pp_address(0) { }
+
+    void reset() override {
+        m_passthrough = false;
+        m_page_program = false;
+        resetSecurity();
+    }
+
+    void command(const std::uint8_t *cmd, std::uint16_t len, std::uint8_t *resp, ntrcard::OpFlags flags) override {
+        if (m_type == 2 && (m_security != Security::RAW || cmd[0] == 0x3C)) {
+            std::uint8_t plain[8];
+            if (secureCommand(cmd, len, resp, plain)) {
+                if (resp) {
+                    std::memset(resp, plain[0] == 0x66 ? 0 : 0xFF, len);
+                }
+                key2Response(resp, len);
+                if (plain[0] == 0x66) {
+                    // type 2 "magic": back to unencrypted commands, with the NOR passthrough on
+                    resetSecurity();
+                    m_passthrough = true;
+                }
+            }
+            return;
+        }
+
+        switch (cmd[0]) {
+            case 0x68: // type 1 "magic": enables the NOR passthrough
+                if (m_type != 1) {
+                    Cart::command(cmd, len, resp, flags);
+                    return;
+                }
+                m_passthrough = true;
+                if (resp) {
+                    std::memset(resp, 0, len);
+                }
+                return;
+            case 0xB7: // ROM read: only follows the NOR when the map at 0x40 is 1:1 (0 => 0, then 0x7FFFFFFF)
+                if (resp) {
+                    static const std::uint8_t identity_map[8] = {0, 0, 0, 0, 0x7F, 0xFF, 0xFF, 0xFF};
+                    std::uint32_t address = (cmd[1] << 24) | (cmd[2] << 16) | (cmd[3] << 8) | cmd[4];
+                    if (address < 0x8000) {
+                        address = 0x8000 + (address & 0x1FF);
+                    }
+                    std::memset(resp, 0xFF, len);
+                    if (!std::memcmp(m_flash.data() + 0x40, identity_map, sizeof(identity_map)) &&
+                        address + len <= m_flash.size()) {
+                        m_flash.read(address, len, resp);
+                    }
+                }
+                return;
+            case 0x99:
+                if (m_passthrough) {
+                    norCommand(cmd, len, resp);
+                } else if (resp) {
+                    std::memset(resp, 0xFF, len);
+                }
+                return;
+            default:
+                Cart::command(cmd, len, resp, flags);
+                return;
+        }
+    }
+};
+}
+
+Cart *createR4iSDHC(int type) {
+    return new R4iSDHC(type);
+}
+}
+}
+
+#endif
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "../ntrcard.h"
+
+// A host-side stand-in for a real cart, so that the drivers in devices/ can be
+// run (and profiled) without a DS/3DS.
+//
+// Build the emulator/ sources with FLASHCART_CORE_EMULATOR defined instead of
+// linking a real platform.cpp. The emulator implements sendCommand, ioDelay,
+// resetCard and initBlowfishPS; showProgress and logMessage are still up to the
+// host. Nothing ever sleeps: every command, ioDelay and flash operation just
+// advances a virtual clock.
+//
+// The emulated DS has hardware KEY2 unless FLASHCART_CORE_EMULATOR_SW_KEY2 is
+// also defined, in which case flashcart_core's software KEY2 has to talk to the
+// carts that use it.
+
+namespace flashcart_core {
+namespace emulator {
+/// Bus activity accumulated since the last `resetStats`.
+struct Stats {
+    /// Number of platform::sendCommand calls
+    std::uint64_t commands;
+    /// Command bytes sent to the cart (8 per command)
+    std::uint64_t bytes_out;
+    /// Response bytes read from the cart
+    std::uint64_t bytes_in;
+    /// Time spent transferring commands and responses
+    std::uint64_t bus_ns;
+    /// Time spent in platform::ioDelay
+    std::uint64_t delay_ns;
+};
+
+/// Erase and program latencies of a flash chip.
+struct NorTiming {
+    /// Time to program one byte (or one page, for page-programmed chips)
+    std::uint64_t program_ns;
+    /// Fixed cost of an erase, regardless of size
+    std::uint64_t erase_ns;
+    /// Additional erase cost per KiB erased
+    std::uint64_t erase_kib_ns;
+};
+
+/// An in-memory NOR array with erase-block geometry and busy timing.
+class NorFlash {
+public:
+    /// `blocks` lists the erase block sizes from address 0; the last entry is
+    /// repeated until `size` is covered.
+    NorFlash(std::uint32_t size, const std::vector<std::uint32_t> &blocks, const NorTiming &timing);
+
+    std::uint32_t size() const { return static_cast<std::uint32_t>(m_data.size()); }
+    std::uint8_t *data() { return m_data.data(); }
+    const NorTiming &timing() const { return m_timing; }
+
+    /// Returns the start and size of the erase block containing `address`.
+    std::uint32_t blockStart(std::uint32_t address) const;
+    std::uint32_t blockSize(std::uint32_t address) const;
+    const std::vector<std::uint32_t> &blockStarts() const { return m_block_starts; }
+
+    /// Whether an erase or program is still in progress at the current virtual time.
+    bool busy() const;
+    /// Whether the operation in progress is an erase.
+    bool erasing() const { return busy() && m_erasing; }
+
+    std::uint8_t read(std::uint32_t address) const;
+    void read(std::uint32_t address, std::uint32_t length, std::uint8_t *out) const;
+    /// Programs a byte (can only clear bits), and goes busy for `program_ns`.
+    void program(std::uint32_t address, std::uint8_t value);
+    /// Programs several bytes as one operation, e.g. an SPI page program.
+    void program(std::uint32_t address, std::uint32_t length, const std::uint8_t *values);
+    void eraseBlock(std::uint32_t address);
+    void eraseRange(std::uint32_t address, std::uint32_t length);
+    void eraseChip();
+
+    std::uint64_t programCount() const { return m_programs; }
+    std::uint64_t eraseCount() const { return m_erases; }
+
+private:
+    std::vector<std::uint8_t> m_data;
+    std::vector<std::uint32_t> m_block_starts;
+    NorTiming m_timing;
+    std::uint64_t m_busy_until;
+    bool m_erasing;
+    std::uint64_t m_programs;
+    std::uint64_t m_erases;
+
+    void goBusy(std::uint64_t ns, bool erasing);
+};
+
+/// KEY2 the way the cart (or, with hardware KEY2, the DS) runs it: both LFSRs a bit at a time,
+/// straight from the seed registers. Kept apart from ntrcard::Key2, so that with
+/// FLASHCART_CORE_EMULATOR_SW_KEY2 the two check each other.
+class Key2Stream {
+public:
+    Key2Stream() : m_x(0), m_y(0) { }
+
+    void seed(std::uint64_t x, std::uint64_t y) { m_x = x; m_y = y; }
+    /// XORs `len` bytes with the keystream; if `data` is null, only advances it.
+    void apply(std::uint8_t *data, std::size_t len);
+
+private:
+    std::uint64_t m_x, m_y;
+};
+
+/// An emulated cart. Implementations decode the cart-specific command set and
+/// act on their `NorFlash`.
+class Cart {
+public:
+    Cart(std::uint32_t chipid, NorFlash flash) : m_chipid(chipid), m_flash(flash), m_security(Security::RAW), m_key2_seeded(false) { }
+    virtual ~Cart() { }
+
+    /// Called on platform::resetCard; drops any protocol state.
+    virtual void reset() { }
+    /// Handles one command; `resp` may be null if the caller discards the response.
+    virtual void command(const std::uint8_t *cmd, std::uint16_t len, std::uint8_t *resp, ntrcard::OpFlags flags);
+
+    NorFlash &flash() { return m_flash; }
+
+protected:
+    std::uint32_t m_chipid;
+    NorFlash m_flash;
+
+    /// Handles the commands every cart answers in RAW mode (dummy, chip ID, header).
+    /// Returns false if `cmd` isn't one of them.
+    bool rawCommand(const std::uint8_t *cmd, std::uint16_t len, std::uint8_t *resp);
+
+    enum class Security { RAW, KEY1, KEY2 };
+    Security m_security;
+
+    /// The cart side of ntrcard::initKey1/initKey2, for carts that are only unlocked through them.
+    /// Call it for every command outside RAW mode, and for 0x3C in RAW mode. Returns true, with
+    /// the decrypted command in `plain`, for a KEY2 command other than the chip ID; the cart then
+    /// answers it and passes its response through `key2Response`.
+    bool secureCommand(const std::uint8_t *cmd, std::uint16_t len, std::uint8_t *resp, std::uint8_t (&plain)[8]);
+    void key2Response(std::uint8_t *resp, std::uint16_t len) { m_key2.apply(resp, len); }
+    /// Back to RAW mode, e.g. on reset.
+    void resetSecurity() { m_security = Security::RAW; m_key2_seeded = false; }
+
+private:
+    std::uint32_t m_key1_ps[ntrcard::BLOWFISH_PS_N];
+    Key2Stream m_key2;
+    bool m_key2_seeded;
+};
+
+/// Acekard 2i; `hw_revision` is 0x44444444 (2 MiB) or 0x81818181 (16 MiB).
+Cart *createAK2i(std::uint32_t hw_revision);
+/// R4i Gold 3DS; `hw_revision` is 0xA7A7A7A7 (type 1, 4 MiB) or 0 (type 2, 2 MiB).
+Cart *createR4iGold3DS(std::uint32_t hw_revision);
+/// DSTT with the given flash chip ID, e.g. 0xBAC2 (AMD commands) or 0x9189 (Intel commands).
+/// Returns nullptr if the chip isn't emulated.
+Cart *createDSTT(std::uint32_t flashchip);
+/// R4iSDHC with a 2 MiB SPI NOR; `type` 1 is unlocked with command 0x68, type 2 with 0x66
+/// after the KEY1/KEY2 handshake.
+Cart *createR4iSDHC(int type);
+
+/// Makes `cart` the cart platform::sendCommand talks to. Ownership stays with the caller.
+void insertCart(Cart *cart);
+Cart *insertedCart();
+
+/// Current virtual time, in nanoseconds.
+std::uint64_t now();
+/// Advances the virtual clock.
+void advance(std::uint64_t ns);
+
+/// Host-side cost of issuing one command (register setup, IRQ, etc.), in nanoseconds.
+void setCommandOverhead(std::uint64_t ns);
+
+const Stats &stats();
+void resetStats();
+}
+}
@@ -1,4 +1,5 @@
 #include <cstdint>
+#include <cstring>
 
 #include "platform.h"
 
@@ -32,6 +33,8 @@ using std::size_t;
 #define CMD_KEY1_SECURE_READ    0x2ull
 #define CMD_KEY1_ACTIVATE_KEY2  0xAull
 
+#define KEY2_MASK               0x7FFFFFFFFFull         // The KEY2 LFSRs are 39 bits wide
+
 #define CMD_KEY2_DATA_READ      0xB7ull
 #define CMD_KEY2_CHIPID         0xB8ull
 
@@ -95,24 +98,61 @@ void blowfish_apply_key(uint32_t (&ps)[BLOWFISH_PS_N], uint32_t key[3]) {
     }
 }
 
+// Keyed P/S tables from previous initKey1 calls, so re-detection doesn't rerun the key schedule.
+// Sized for R4iSDHC trying NTR, B9RETAIL and B9DEV in turn.
+struct BlowfishCacheEntry {
+    bool valid;
+    BlowfishKey key;
+    uint32_t game_code;
+    uint32_t ps[BLOWFISH_PS_N];
+};
+BlowfishCacheEntry blowfish_cache[3];
+size_t blowfish_cache_next = 0;
+
+void blowfish_cache_insert(BlowfishKey key, uint32_t game_code, const uint32_t (&ps)[BLOWFISH_PS_N]) {
+    BlowfishCacheEntry &entry = blowfish_cache[blowfish_cache_next];
+    blowfish_cache_next = (blowfish_cache_next + 1) % (sizeof(blowfish_cache) / sizeof(blowfish_cache[0]));
+
+    entry.valid = true;
+    entry.key = key;
+    entry.game_code = game_code;
+    std::memcpy(entry.ps, ps, sizeof(entry.ps));
+}
+
 void init_blowfish(BlowfishKey key) {
-    if (key != BlowfishKey::NTR) {
+    // Only the NTR table is keyed with the game code.
+    const uint32_t game_code = key == BlowfishKey::NTR ? state.game_code : 0;
+
+    state.key1_key[0] = game_code;
+    state.key1_key[1] = game_code >> 1;
+    state.key1_key[2] = game_code << 1;
+
+    for (const BlowfishCacheEntry &entry : blowfish_cache) {
+        if (entry.valid && entry.key == key && entry.game_code == game_code) {
+            platform::logMessage(LOG_DEBUG, "Blowfish: using cached table (key = %d, game_code = 0x%X)",
+                static_cast<int>(key), game_code);
+            std::memcpy(state.key1_ps, entry.ps, sizeof(state.key1_ps));
+            return;
+        }
+    }
+
+    if (!platform::loadKeyedBlowfishPS(state.key1_ps, key, game_code)) {
         platform::initBlowfishPS(state.key1_ps, key);
-    } else {
-        state.key1_key[0] = state.game_code;
-        state.key1_key[1] = state.game_code >> 1;
-        state.key1_key[2] = state.game_code << 1;
 
-        platform::initBlowfishPS(state.key1_ps, BlowfishKey::NTR);
+        if (key == BlowfishKey::NTR) {
+            blowfish_apply_key(state.key1_ps, state.key1_key);
+            blowfish_apply_key(state.key1_ps, state.key1_key);
+        }
 
-        blowfish_apply_key(state.key1_ps, state.key1_key);
-        blowfish_apply_key(state.key1_ps, state.key1_key);
+        platform::storeKeyedBlowfishPS(state.key1_ps, key, game_code);
     }
+
+    blowfish_cache_insert(key, game_code, state.key1_ps);
 }
 
 void read_header() {
     uint8_t hdr[0x1000];
-    ntrcard::sendCommand(CMD_RAW_HEADER_READ, 0x1000, hdr, ROMCNT_CLK_SLOW | ROMCNT_DELAY2(0x18));
+    ntrcard::sendCommand(static_cast<uint64_t>(CMD_RAW_HEADER_READ), 0x1000, hdr, ROMCNT_CLK_SLOW | ROMCNT_DELAY2(0x18));
 
     state.game_code = *reinterpret_cast<uint32_t *>(hdr + 0xC);
     state.hdr_key1_romcnt = state.key1_romcnt = *reinterpret_cast<uint32_t *>(hdr + 0x64);
@@ -134,7 +174,10 @@ void key1_cmdf(const uint8_t cmdarg, const uint32_t size, uint8_t *const dest, c
         ((k & 0xFFull) << 56 /* 56 - 0 */);
     cmd = BSWAP64(cmd);
     platform::logMessage(LOG_DEBUG, "Sending KEY1 cmd: %016llX (plaintext)", cmd);
-    blowfish_encrypt(state.key1_ps, reinterpret_cast<uint32_t *>(&cmd));
+    // not through a uint32_t * into cmd: that breaks strict aliasing, and at -O2 the command goes out unencrypted
+    uint32_t lr[2] = {static_cast<uint32_t>(cmd), static_cast<uint32_t>(cmd >> 32)};
+    blowfish_encrypt(state.key1_ps, lr);
+    cmd = lr[0] | (static_cast<uint64_t>(lr[1]) << 32);
     ntrcard::sendCommand(BSWAP64(cmd), size, dest, flags);
 }
 
@@ -149,8 +192,54 @@ void seed_key2_registers(void) {
     platform::logMessage(LOG_DEBUG, "Seed KEY2: %llX %llX", state.key2_x, state.key2_y);
     if (platform::HAS_HW_KEY2) {
         platform::initKey2Seed(state.key2_x, state.key2_y);
+    } else {
+        state.key2.seed(state.key2_x, state.key2_y);
+    }
+}
+
+constexpr uint64_t key2_reverse(uint64_t seed) {
+    // LSB of the seed register is the MSB of the LFSR
+    uint64_t reversed = 0;
+    for (int i = 0; i < 39; ++i) {
+        reversed |= ((seed >> i) & 1) << (38 - i);
     }
+    return reversed;
+}
+
+// Advances both LFSRs by 8 bits and returns the keystream byte.
+constexpr uint8_t key2_step(uint64_t &x, uint64_t &y) {
+    x = (((x >> 5) ^ (x >> 17) ^ (x >> 18) ^ (x >> 31)) & 0xFF) | ((x << 8) & KEY2_MASK);
+    y = (((y >> 5) ^ (y >> 23) ^ (y >> 18) ^ (y >> 31)) & 0xFF) | ((y << 8) & KEY2_MASK);
+    return static_cast<uint8_t>(x ^ y);
 }
+
+// The same LFSRs one bit at a time, as they're usually described: shift left, feeding in the XOR of
+// bits 12, 24, 25 and 38 (X) or 12, 30, 25 and 38 (Y).
+constexpr uint64_t key2_bit(uint64_t r, int t0, int t1, int t2, int t3) {
+    return ((r << 1) & KEY2_MASK) | (((r >> t0) ^ (r >> t1) ^ (r >> t2) ^ (r >> t3)) & 1);
+}
+
+// Whether key2_step's byte-at-a-time shortcut gives the same registers and keystream as the bitwise
+// LFSRs for the first `bytes` bytes after seeding with `seed_x`/`seed_y`.
+constexpr bool key2_step_matches_bitwise(uint64_t seed_x, uint64_t seed_y, int bytes) {
+    uint64_t x = key2_reverse(seed_x), y = key2_reverse(seed_y);
+    uint64_t bx = x, by = y;
+    for (int i = 0; i < bytes; ++i) {
+        const uint8_t key = key2_step(x, y);
+        for (int b = 0; b < 8; ++b) {
+            bx = key2_bit(bx, 12, 24, 25, 38);
+            by = key2_bit(by, 12, 30, 25, 38);
+        }
+        if (bx != x || by != y || static_cast<uint8_t>(bx ^ by) != key) {
+            return false;
+        }
+    }
+    return true;
+}
+// the power-on seeds, and a seed with every bit set (so all 39 bits, and the mask, are exercised)
+static_assert(key2_step_matches_bitwise(0x58C56DE0E8ull, 0x5C879B9B05ull, 64), "KEY2 byte step is wrong");
+static_assert(key2_step_matches_bitwise(KEY2_MASK, KEY2_MASK, 64), "KEY2 byte step is wrong");
+static_assert(key2_reverse(1) == (1ull << 38) && key2_reverse(1ull << 38) == 1, "KEY2 seed reversal is wrong");
 }
 
 namespace ntrcard {
@@ -169,19 +258,104 @@ static_assert(OpFlags(0)
 
 State state;
 
+void Key2::seed(uint64_t seed_x, uint64_t seed_y) {
+    x = key2_reverse(seed_x);
+    y = key2_reverse(seed_y);
+}
+
+void Key2::apply(uint8_t *data, size_t len) {
+    if (!data) {
+        while (len--) {
+            key2_step(x, y);
+        }
+        return;
+    }
+
+    // Build the keystream a word at a time so bulk responses are XORed 4 bytes per iteration.
+    for (; len >= 4; data += 4, len -= 4) {
+        uint32_t word, key = key2_step(x, y);
+        key |= key2_step(x, y) << 8;
+        key |= key2_step(x, y) << 16;
+        key |= static_cast<uint32_t>(key2_step(x, y)) << 24;
+        std::memcpy(&word, data, 4);
+        word ^= key;
+        std::memcpy(data, &word, 4);
+    }
+    while (len--) {
+        *data++ ^= key2_step(x, y);
+    }
+}
+
 bool sendCommand(const uint8_t *cmdbuf, uint16_t response_len, uint8_t *resp, OpFlags flags) {
     platform::logMessage(LOG_DEBUG, "Sending cmd: %02X %02X %02X %02X %02X %02X %02X %02X ",
         cmdbuf[0], cmdbuf[1], cmdbuf[2], cmdbuf[3], cmdbuf[4], cmdbuf[5], cmdbuf[6], cmdbuf[7]);
     if (state.status == Status::KEY2) {
         flags = flags.key2_command(true).key2_response(true);
     }
-    return platform::sendCommand(cmdbuf, response_len, resp, flags);
+    if (platform::HAS_HW_KEY2) {
+        return platform::sendCommand(cmdbuf, response_len, resp, flags);
+    }
+
+    // No hardware KEY2: encrypt/decrypt here and send everything to the platform raw.
+    const bool key2_command = flags.key2_command();
+    const bool key2_response = flags.key2_response();
+    uint8_t enc_cmdbuf[8];
+    if (key2_command) {
+        std::memcpy(enc_cmdbuf, cmdbuf, sizeof(enc_cmdbuf));
+        state.key2.apply(enc_cmdbuf, sizeof(enc_cmdbuf));
+        cmdbuf = enc_cmdbuf;
+    }
+
+    bool ret = platform::sendCommand(cmdbuf, response_len, resp, flags.key2_command(false).key2_response(false));
+    if (key2_response) {
+        state.key2.apply(resp, response_len);
+    }
+    return ret;
 }
 
 bool sendCommand(const uint64_t cmd, uint16_t response_len, uint8_t *resp, OpFlags flags) {
     return sendCommand(reinterpret_cast<const uint8_t *>(&cmd), response_len, resp, flags);
 }
 
+bool sendCommands(const Command *cmds, size_t count) {
+    bool needs_key2 = state.status == Status::KEY2;
+    for (size_t i = 0; i < count && !needs_key2; ++i) {
+        needs_key2 = cmds[i].flags.key2_command() || cmds[i].flags.key2_response();
+    }
+
+    if (needs_key2) {
+        // KEY2 flags and (without hardware KEY2) the keystream have to be handled command by command
+        bool ret = true;
+        for (size_t i = 0; i < count; ++i) {
+            ret = sendCommand(cmds[i].cmdbuf, cmds[i].response_len, cmds[i].resp, cmds[i].flags) && ret;
+        }
+        return ret;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        const uint8_t *cmdbuf = cmds[i].cmdbuf;
+        platform::logMessage(LOG_DEBUG, "Sending cmd: %02X %02X %02X %02X %02X %02X %02X %02X (batched)",
+            cmdbuf[0], cmdbuf[1], cmdbuf[2], cmdbuf[3], cmdbuf[4], cmdbuf[5], cmdbuf[6], cmdbuf[7]);
+    }
+    return platform::sendCommands(cmds, count);
+}
+
+void CommandBatch::add(const uint8_t *cmdbuf, uint16_t resplen, uint8_t *resp, OpFlags flags) {
+    Command cmd = {{0}, resplen, resp, flags};
+    std::memcpy(cmd.cmdbuf, cmdbuf, sizeof(cmd.cmdbuf));
+    cmds.push_back(cmd);
+}
+
+void CommandBatch::add(const uint64_t cmd, uint16_t resplen, uint8_t *resp, OpFlags flags) {
+    add(reinterpret_cast<const uint8_t *>(&cmd), resplen, resp, flags);
+}
+
+bool CommandBatch::send() {
+    bool ret = cmds.empty() || sendCommands(cmds.data(), cmds.size());
+    cmds.clear();
+    return ret;
+}
+
 bool init() {
     if (platform::CAN_RESET) {
         uint32_t reset_result = platform::resetCard();
@@ -208,11 +382,6 @@ bool init() {
 }
 
 bool initKey1(BlowfishKey key) {
-    if (!platform::HAS_HW_KEY2) {
-        platform::logMessage(LOG_ERR, "Key1 fail due to no Key2 support");
-        return false; // TODO impl SW KEY2
-    }
-
     if (state.status != Status::RAW) {
         platform::logMessage(LOG_ERR,
             "Trying to init KEY1 from not RAW (status = %d)",
@@ -252,11 +421,6 @@ bool initKey1(BlowfishKey key) {
 }
 
 bool initKey2() {
-    if (!platform::HAS_HW_KEY2) {
-        platform::logMessage(LOG_ERR, "Key2 fail due to no Key2 support");
-        return false; // TODO impl SW KEY2
-    }
-
     if (state.status != Status::KEY1) {
         platform::logMessage(LOG_ERR,
             "Trying to init KEY2 from not KEY1 (status = %d)",
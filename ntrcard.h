@@ -1,6 +1,8 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <vector>
 
 namespace flashcart_core {
 namespace ntrcard {
@@ -16,6 +18,18 @@ enum class Status {
     RAW, KEY1, KEY2, UNKNOWN
 };
 
+/// Software KEY2 stream cipher, used when `!platform::HAS_HW_KEY2`.
+class Key2 {
+    /// The (bit-reversed) X and Y LFSRs
+    std::uint64_t x, y;
+public:
+    /// Seeds the LFSRs from seed values as written to the hardware seed registers.
+    void seed(std::uint64_t seed_x, std::uint64_t seed_y);
+    /// Encrypts or decrypts `len` bytes in place. If `data` is null, the stream is
+    /// only advanced (e.g. for a response the caller discards).
+    void apply(std::uint8_t *data, std::size_t len);
+};
+
 struct State {
 public:
     /// The chip ID, stored in `ntrcard_init`
@@ -55,6 +69,8 @@ public:
     std::uint64_t key2_x;
     /// The KEY2 Y register
     std::uint64_t key2_y;
+    /// The software KEY2 stream, seeded from key2_x/key2_y
+    Key2 key2;
 
     /// The current status
     Status status;
@@ -97,10 +113,37 @@ public:
     constexpr OpFlags(const std::uint32_t& from) : romcnt(from) {}
 };
 
+/// A command submitted as part of a batch; see `sendCommands`.
+struct Command {
+    std::uint8_t cmdbuf[8];
+    std::uint16_t response_len;
+    /// May be null if the response is discarded.
+    std::uint8_t *resp;
+    OpFlags flags;
+};
+
+/// Collects commands so they can be sent back to back with `sendCommands`.
+/// Drivers keep one as a member and reuse it, so building a command stream doesn't allocate
+/// every time. Responses go straight to `resp`, whose whole `resplen` is written: a read that
+/// would run past the end of the caller's buffer has to go through a bounce buffer instead, and
+/// be copied out after `send`.
+class CommandBatch {
+    std::vector<Command> cmds;
+public:
+    void add(const std::uint8_t *cmdbuf, std::uint16_t resplen = 0, std::uint8_t *resp = nullptr, OpFlags flags = OpFlags(32));
+    void add(const std::uint64_t cmd, std::uint16_t resplen = 0, std::uint8_t *resp = nullptr, OpFlags flags = OpFlags(32));
+    std::size_t size() const { return cmds.size(); }
+    /// Sends all queued commands, in order, and empties the batch.
+    bool send();
+};
+
 extern State state;
 
 bool sendCommand(const std::uint8_t *cmdbuf, std::uint16_t resplen, std::uint8_t *resp, OpFlags flags = OpFlags(32));
 bool sendCommand(const std::uint64_t cmd, std::uint16_t resplen, std::uint8_t *resp, OpFlags flags = OpFlags(32));
+/// Sends `count` commands back to back. Responses are only guaranteed to be filled in once
+/// this returns, so a command's contents can't depend on an earlier command's response.
+bool sendCommands(const Command *cmds, std::size_t count);
 bool init();
 bool initKey1(BlowfishKey key = BlowfishKey::NTR);
 bool initKey2();
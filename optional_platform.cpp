@@ -1,5 +1,6 @@
 // This file is so named to avoid build-time object file conflicts with platform.cpp in ntrboot_flasher
 
+#include <cstddef>
 #include <cstdint>
 
 #include "platform.h"
@@ -27,6 +28,22 @@ __attribute__((weak)) std::int32_t resetCard() {
     return -1;
 }
 
+__attribute__((weak)) bool sendCommands(const ntrcard::Command *cmds, std::size_t count) {
+    bool ret = true;
+    for (std::size_t i = 0; i < count; ++i) {
+        ret = platform::sendCommand(cmds[i].cmdbuf, cmds[i].response_len, cmds[i].resp, cmds[i].flags) && ret;
+    }
+    return ret;
+}
+
+__attribute__((weak)) bool yieldWait(std::uint32_t us) { return false; }
+
 __attribute__((weak)) void initKey2Seed(std::uint64_t x, std::uint64_t y) {}
+
+__attribute__((weak)) bool loadKeyedBlowfishPS(std::uint32_t (&ps)[ntrcard::BLOWFISH_PS_N], ntrcard::BlowfishKey key, std::uint32_t game_code) {
+    return false;
+}
+
+__attribute__((weak)) void storeKeyedBlowfishPS(const std::uint32_t (&ps)[ntrcard::BLOWFISH_PS_N], ntrcard::BlowfishKey key, std::uint32_t game_code) {}
 }
 }
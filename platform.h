@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 
 #include "ntrcard.h"
@@ -17,7 +18,7 @@ enum log_priority {
 // override these in platform.cpp
 namespace platform {
 /// Whether the platform has hardware KEY2 support.
-/// If false, flashcart_core will do KEY2 in software. (TODO IMPL)
+/// If false, flashcart_core will do KEY2 in software.
 /// If unset, defaults to false.
 extern const bool HAS_HW_KEY2;
 
@@ -32,10 +33,34 @@ extern const ntrcard::Status INITIAL_ENCRYPTION;
 
 std::int32_t resetCard();
 bool sendCommand(const std::uint8_t *cmdbuf, std::uint16_t response_len, std::uint8_t *resp, ntrcard::OpFlags flags);
+/// Sends `count` commands back to back, e.g. from a DMA or FIFO queue.
+/// Only called with raw (non-KEY2) commands.
+/// If unset, calls `sendCommand` for each command in turn.
+bool sendCommands(const ntrcard::Command *cmds, std::size_t count);
 void ioDelay(std::uint32_t us);
+/// Cooperative yield hook, called whenever a driver is waiting on the cart: with the length
+/// of the wait in us (long delays are split into slices of at most 10ms), or with 0 between
+/// busy polls. A host with an event loop can use this to keep its UI or logging going while
+/// an erase or program is in flight. The Flashcart call is still running underneath and
+/// can't be paused: it carries on as soon as this returns. (To get control back between
+/// steps of a write instead, see `Flashcart::startWrite`.)
+/// This must not call back into flashcart_core (no Flashcart or ntrcard calls, including on
+/// another cart): the card state and the drivers are globals the waiting call is using.
+/// Return true if the platform has already spent `us` (e.g. sleeping the thread or
+/// servicing its event loop), false to have flashcart_core call `ioDelay` instead.
+/// If unset, returns false.
+bool yieldWait(std::uint32_t us);
 void initBlowfishPS(std::uint32_t (&ps)[ntrcard::BLOWFISH_PS_N], ntrcard::BlowfishKey key = ntrcard::BlowfishKey::NTR);
 void initKey2Seed(std::uint64_t x, std::uint64_t y);
 
+/// Optional persistent storage for keyed KEY1 Blowfish tables (i.e. `initBlowfishPS`
+/// after the key schedule for `game_code` has been applied), so a new session can skip
+/// the key schedule. `game_code` is 0 for keys that aren't keyed by game code.
+/// `loadKeyedBlowfishPS` returns false if it has no table for (`key`, `game_code`).
+/// If unset, nothing is persisted and flashcart_core only caches tables in memory.
+bool loadKeyedBlowfishPS(std::uint32_t (&ps)[ntrcard::BLOWFISH_PS_N], ntrcard::BlowfishKey key, std::uint32_t game_code);
+void storeKeyedBlowfishPS(const std::uint32_t (&ps)[ntrcard::BLOWFISH_PS_N], ntrcard::BlowfishKey key, std::uint32_t game_code);
+
 void showProgress(std::uint32_t current, std::uint32_t total, const char* status_string);
 int logMessage(log_priority priority, const char *fmt, ...);
 }